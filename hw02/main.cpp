@@ -12,11 +12,32 @@
 #include <list>
 #include <algorithm>
 #include <memory>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <csignal>
 using namespace std;
 #endif /* __PROGTEST__ */
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+class CPersistentVATRegister;
 
 class CVATRegister {
+    friend class CPersistentVATRegister;
     public:
         CVATRegister ( void );
         ~CVATRegister ( void );
@@ -37,348 +58,515 @@ class CVATRegister {
         bool firstCompany ( string & name, string & addr ) const;
         bool nextCompany ( string & name, string & addr ) const;
 
-        struct Company {
+        struct CompareNameAddr {
             private:
-                string mName;
-                string mAddr;
-                string mId;
-                unsigned int mAmount;
+                inline char normalizeChar(const char c) const {
+                    return ('a' <= c && c <= 'z') ? c : c - ('A' - 'a');
+                }
+#if defined(__AVX2__)
+                /** Converts 'A'-'Z' to lower case, other bytes are kept */
+                static inline __m256i foldCase(const __m256i x) {
+                    const __m256i upper = _mm256_and_si256(
+                            _mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+                    return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+                }
+#endif
+#if defined(__SSE2__)
+                /** Converts 'A'-'Z' to lower case, other bytes are kept */
+                static inline __m128i foldCase(const __m128i x) {
+                    const __m128i upper = _mm_and_si128(
+                            _mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+                            _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+                    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+                }
+#endif
+                /**
+                 * Finds the first index where the strings differ ignoring case
+                 * Compares 32 or 16 bytes at once when AVX2 or SSE2 is available,
+                 * the rest is compared char by char
+                 */
+                inline size_t firstMismatch(const char * s1, const char * s2, const size_t length) const {
+                    size_t i = 0;
+#if defined(__AVX2__)
+                    for (; i + 32 <= length; i += 32) {
+                        const __m256i a = foldCase(_mm256_loadu_si256((const __m256i *) (s1 + i)));
+                        const __m256i b = foldCase(_mm256_loadu_si256((const __m256i *) (s2 + i)));
+                        const unsigned int equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+                        if (equal != 0xFFFFFFFFu) return i + __builtin_ctz(~equal);
+                    }
+#endif
+#if defined(__SSE2__)
+                    for (; i + 16 <= length; i += 16) {
+                        const __m128i a = foldCase(_mm_loadu_si128((const __m128i *) (s1 + i)));
+                        const __m128i b = foldCase(_mm_loadu_si128((const __m128i *) (s2 + i)));
+                        const unsigned int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+                        if (equal != 0xFFFFu) return i + __builtin_ctz(~equal);
+                    }
+#endif
+                    for (; i < length; i++)
+                        if (normalizeChar(s1[i]) != normalizeChar(s2[i])) return i;
+                    return length;
+                }
+                inline char comp (const string_view s1, const string_view s2) const {
+                    // folding 'A'-'Z' finds exactly the same mismatches as normalizeChar,
+                    // the order is decided by normalizeChar
+                    size_t length = min(s1.length(), s2.length());
+                    size_t i = firstMismatch(s1.data(), s2.data(), length);
+                    if (i < length)
+                        return normalizeChar(s1[i]) < normalizeChar(s2[i]) ? -1 : 1;
+                    if (s1.length() < s2.length()) return -1;
+                    if (s1.length() > s2.length()) return  1;
+                    return 0;
+                }
             public:
-                Company(const string & name, const string & addr,
-                        const string & id, unsigned int amount = 0)
-                    : mName(name), mAddr(addr), mId(id), mAmount(amount) {}
-                /*Company(const Company & c)
-                  :mName(c.mName), mAddr(c.mAddr), mId(c.mId), mAmount(c.mAmount) {}
-
-                  inline Company operator = (const Company & c) {
-                  return Company(c);
-                  }*/
-
-                void addAmount(unsigned int amount);
-                const string & getName() const;
-                const string & getAddr() const;
-                unsigned int getAmount() const;
-                void print(ostream & out) const;
+                inline bool operator () (const string_view s1, const string_view s2) const {
+                    return comp(s1, s2) < 0;
+                }
+                /** Compares (name1, addr1) and (name2, addr2) pairs, returns <0, 0 or >0 */
+                inline char compare (const string_view name1, const string_view addr1,
+                        const string_view name2, const string_view addr2) const {
+                    char nameCmp = comp(name1, name2);
+                    if (nameCmp != 0) return nameCmp;
+                    return comp(addr1, addr2);
+                }
+        };
 
-                struct CompareNameAddr {
-                    private:
-                        inline char normalizeChar(const char c) const {
-                            return ('a' <= c && c <= 'z') ? c : c - ('A' - 'a');
-                        }
-                        inline char comp (const string & s1, const string & s2) const {
-                            size_t length = min(s1.length(), s2.length());
-                            for (size_t i = 0; i < length; i++) {
-                                char c1 = normalizeChar(s1.at(i));
-                                char c2 = normalizeChar(s2.at(i));
-                                if (c1 < c2) return -1;
-                                else if (c1 > c2) return 1;
-                            }
-                            if (s1.length() < s2.length()) return -1;
-                            if (s1.length() > s2.length()) return  1;
-                            return 0;
-                        }
-                    public:
-                        inline bool operator () (const string & s1, const string & s2) const {
-                            return comp(s1, s2) < 0;
-                        }
-                        inline bool operator() (const Company * c1, const Company * c2) const {
-                            char nameCmp = comp(c1 -> mName, c2 -> mName);
-                            if (nameCmp < 0) return true;
-                            if (nameCmp > 0) return false;
-                            if (comp(c1 -> mAddr, c2 -> mAddr) < 0) return true;
-                            return false;
-                        }
-                };
-                struct CompareId {
-                    public:
-                        inline bool operator() (const Company * c1, const Company * c2) const {
-                            return c1 -> mId < c2 -> mId;
-                        }
+        /** Index of a company in CompanyPool */
+        typedef unsigned int Handle;
+
+        /**
+         * Struct-of-arrays storage of all the companies
+         * Name, address and tax ID of a company are stored back to back
+         * in a single string arena, records hold only the offset and lengths.
+         * Handles of cancelled companies are reused, the arena is compacted
+         * once more than a half of it is dead.
+         * The arena is limited to 4 GB as offsets are 32 bit,
+         * add() fails for a company that does not fit any more.
+         */
+        class CompanyPool {
+            friend class ::CPersistentVATRegister;
+            private:
+                struct Record {
+                    unsigned int mOffset;
+                    unsigned int mNameLen;
+                    unsigned int mAddrLen;
+                    unsigned int mIdLen;
                 };
+                static const unsigned int FREE = ~0u;
+
+                string mArena;
+                vector<Record> mRecords;
+                vector<unsigned int> mAmounts;
+                vector<Handle> mFree;
+                size_t mDeadBytes = 0;
+            public:
+                bool add(const string & name, const string & addr, const string & id, Handle & h);
+                void remove(const Handle h);
+                string_view getName(const Handle h) const;
+                string_view getAddr(const Handle h) const;
+                string_view getId(const Handle h) const;
+                void addAmount(const Handle h, const unsigned int amount);
+                unsigned int getAmount(const Handle h) const;
+                size_t memoryUsage() const;
+                void clear();
+                void print(const Handle h, ostream & out) const;
+            private:
+                void compact();
         };
 
-        template <class Compare>
+        /**
+         * Binary heap generalized to Arity children per node
+         * Compare works like in std::priority_queue - the top item is the one
+         * for which Compare returns false against every other item
+         * 4 children per node keep all the siblings in a single cache line
+         */
+        template <class Compare, class T = unsigned int, size_t Arity = 4>
         class PriorityQueue {
+            static_assert(Arity >= 2, "Heap has to have at least 2 children per node");
+            friend class ::CPersistentVATRegister;
             private:
-                vector<unsigned int> mData;
+                vector<T> mData;
                 Compare mCmp;
             public:
-                unsigned int & top();
-                unsigned int top() const;
-                PriorityQueue<Compare> & push(const unsigned int item);
-                unsigned int pop();
+                T & top();
+                const T & top() const;
+                PriorityQueue & push(const T & item);
+                T pop();
+                T replaceTop(const T & item);
+                template <class It>
+                PriorityQueue & heapify(It first, It last);
+                void reserve(const size_t capacity);
                 size_t size() const;
                 size_t lastIndex() const;
                 bool empty() const;
                 void clear();
                 void print(ostream & out) const;
             private:
-                void repairTop();
-                void repairChild();
-                void repairTop(const size_t topIndex);
-                void repairChild(const size_t childIndex);
-                void swapItems(const size_t i1, const size_t i2);
+                void repairTop(size_t topIndex);
+                void repairChild(size_t childIndex);
                 size_t parInd(const size_t index) const;
-                size_t leftInd(const size_t index) const;
-                size_t rightInd(const size_t index) const;
+                size_t childInd(const size_t index) const;
+        };
+
+        /**
+         * Tracks the median of all the added items
+         * The lower half is kept in a max heap, the upper half in a min heap
+         */
+        class MedianTracker {
+            friend class ::CPersistentVATRegister;
+            private:
+                PriorityQueue<less<unsigned int>> mSmaller;
+                PriorityQueue<greater<unsigned int>> mGreater;
+            public:
+                void add(const unsigned int amount);
+                unsigned int median() const;
+                void clear();
         };
 
+        size_t memoryUsage() const;
         void printList(ostream & out) const;
         void printIds(ostream & out) const;
 
     private:
-        vector<Company*> mList;
-        vector<Company*> mIds;
-        PriorityQueue<less<unsigned int>> mSmaller;
-        PriorityQueue<greater<unsigned int>> mGreater;
+        CompanyPool mPool;
+        vector<Handle> mList;
+        vector<Handle> mIds;
+        MedianTracker mInvoices;
 
-        void addInvoice(const unsigned int amount);
-        bool bSearchName(const Company * c, size_t & index) const;
-        bool bSearchId(const Company * c, size_t & index) const;
+        bool bSearchName(const string_view name, const string_view addr, size_t & index) const;
+        bool bSearchId(const string_view taxID, size_t & index) const;
 };
 
 typedef CVATRegister Reg;
 
 Reg::CVATRegister(void) {}
 Reg::~CVATRegister(void) {
-    for (auto ptr : mList) delete ptr;
+    mPool.clear();
     mList.clear();
     mIds.clear();
-    mSmaller.clear();
-    mGreater.clear();
+    mInvoices.clear();
 }
 
 bool Reg::newCompany ( const string & name, const string & addr, const string & taxID ) {
-    Company * c = new Company(name, addr, taxID);
     size_t indexName, indexId;
-    if (bSearchName(c, indexName) || bSearchId(c, indexId)) {
-        delete c;
+    if (bSearchName(name, addr, indexName) || bSearchId(taxID, indexId)) {
         return false;
     } else {
-        mList.insert(mList.begin() + indexName, c);
-        mIds.insert(mIds.begin() + indexId, c);
+        Handle h;
+        if (!mPool.add(name, addr, taxID, h)) return false;
+        mList.insert(mList.begin() + indexName, h);
+        mIds.insert(mIds.begin() + indexId, h);
         return true;
     }
 }
 
 bool Reg::cancelCompany ( const string & name, const string & addr ) {
-    Company c(name, addr, "");
     size_t indexName, indexId;
-    if (bSearchName(&c, indexName)) {
-        const Company * toDelete = mList[indexName];
-        bSearchId(toDelete, indexId);
+    if (bSearchName(name, addr, indexName)) {
+        const Handle toDelete = mList[indexName];
+        bSearchId(mPool.getId(toDelete), indexId);
         mList.erase(mList.begin() + indexName);
         mIds.erase(mIds.begin() + indexId);
-        delete toDelete;
+        mPool.remove(toDelete);
         return true;
     } else return false;
 }
 bool Reg::cancelCompany ( const string & taxID ) {
-    Company c("", "", taxID);
     size_t indexName, indexId;
-    if (bSearchId(&c, indexId)) {
-        const Company * toDelete = mIds[indexId];
-        bSearchName(toDelete, indexName);
+    if (bSearchId(taxID, indexId)) {
+        const Handle toDelete = mIds[indexId];
+        bSearchName(mPool.getName(toDelete), mPool.getAddr(toDelete), indexName);
         mList.erase(mList.begin() + indexName);
         mIds.erase(mIds.begin() + indexId);
-        delete toDelete;
+        mPool.remove(toDelete);
         return true;
     } else return false;
 }
 
 bool Reg::invoice ( const string & name, const string & addr, unsigned int amount ) {
-    Company c(name, addr, "");
     size_t indexName;
-    if (bSearchName(&c, indexName)) {
-        mList[indexName] -> addAmount(amount);
-        addInvoice(amount);
+    if (bSearchName(name, addr, indexName)) {
+        mPool.addAmount(mList[indexName], amount);
+        mInvoices.add(amount);
         return true;
     } else return false;
 }
 bool Reg::invoice ( const string & taxID, unsigned int amount ) {
-    Company c("", "", taxID);
     size_t indexId;
-    if (bSearchId(&c, indexId)) {
-        mIds[indexId] -> addAmount(amount);
-        addInvoice(amount);
+    if (bSearchId(taxID, indexId)) {
+        mPool.addAmount(mIds[indexId], amount);
+        mInvoices.add(amount);
         return true;
     } else return false;
 }
-void Reg::addInvoice(const unsigned int amount) {
-    if (mSmaller.empty()) mGreater.push(amount);
-    else if (mSmaller.top() < amount) mGreater.push(amount);
-    else mSmaller.push(amount);
-    if (mSmaller.size() > mGreater.size())
-        mGreater.push(mSmaller.pop());
-    else if (mSmaller.size() + 1 < mGreater.size())
-        mSmaller.push(mGreater.pop());
+void Reg::MedianTracker::add(const unsigned int amount) {
+    // mGreater holds the same number of items as mSmaller or one more,
+    // an item crossing between the heaps replaces the other heap's top
+    if (!mSmaller.empty() && amount <= mSmaller.top()) {
+        if (mSmaller.size() < mGreater.size()) mSmaller.push(amount);
+        else mGreater.push(mSmaller.replaceTop(amount));
+    } else {
+        if (mGreater.size() <= mSmaller.size()) mGreater.push(amount);
+        else if (amount <= mGreater.top()) mSmaller.push(amount);
+        else mSmaller.push(mGreater.replaceTop(amount));
+    }
+}
+
+unsigned int Reg::MedianTracker::median() const {
+    if (mGreater.empty()) return 0;
+    return mGreater.top();
+}
+void Reg::MedianTracker::clear() {
+    mSmaller.clear();
+    mGreater.clear();
 }
 
 
 bool Reg::audit ( const string & name, const string & addr, unsigned int & sumIncome ) const {
-    Company c(name, addr, "");
     size_t indexName;
-    if (bSearchName(&c, indexName)) {
-        sumIncome = mList[indexName] -> getAmount();
+    if (bSearchName(name, addr, indexName)) {
+        sumIncome = mPool.getAmount(mList[indexName]);
         return true;
     } else return false;
 }
 bool Reg::audit ( const string & taxID, unsigned int & sumIncome ) const {
-    Company c("", "", taxID);
     size_t indexId;
-    if (bSearchId(&c, indexId)) {
-        sumIncome = mIds[indexId] -> getAmount();
+    if (bSearchId(taxID, indexId)) {
+        sumIncome = mPool.getAmount(mIds[indexId]);
         return true;
     } else return false;
 }
 
 unsigned int Reg::medianInvoice ( void ) const {
-    if (mGreater.empty()) return 0;
-    return mGreater.top();
+    return mInvoices.median();
 }
 
 bool Reg::firstCompany ( string & name, string & addr ) const {
     if (mList.size() == 0) return false;
-    const Company * c = mList[0];
-    name = c -> getName();
-    addr = c -> getAddr();
+    const Handle h = mList[0];
+    name = mPool.getName(h);
+    addr = mPool.getAddr(h);
     return true;
 }
 bool Reg::nextCompany ( string & name, string & addr ) const {
-    Company c(name, addr, "");
     size_t indexName;
-    if (bSearchName(&c, indexName)) {
+    if (bSearchName(name, addr, indexName)) {
         if (indexName + 1 >= mList.size()) return false;
-        Company * next = mList[indexName + 1];
-        name = next -> getName();
-        addr = next -> getAddr();
+        const Handle next = mList[indexName + 1];
+        name = mPool.getName(next);
+        addr = mPool.getAddr(next);
         return true;
     } else return false;
 }
 
-bool Reg::bSearchName(const Reg::Company * c, size_t & index) const {
-    Reg::Company::CompareNameAddr cmp;
+size_t Reg::memoryUsage() const {
+    return sizeof(*this) + mPool.memoryUsage()
+        + (mList.capacity() + mIds.capacity()) * sizeof(Handle);
+}
+
+bool Reg::bSearchName(const string_view name, const string_view addr, size_t & index) const {
+    CompareNameAddr cmp;
     auto & list = mList;
-    auto lower = lower_bound(list.begin(), list.end(), c, cmp);
+    auto lower = partition_point(list.begin(), list.end(), [&](const Handle h) {
+        return cmp.compare(mPool.getName(h), mPool.getAddr(h), name, addr) < 0;
+    });
     index = distance(list.begin(), lower);
     if (lower == list.end()) return false;
-    return !cmp(*lower, c) && !cmp(c, *lower);
+    return cmp.compare(mPool.getName(*lower), mPool.getAddr(*lower), name, addr) == 0;
 }
-bool Reg::bSearchId(const Reg::Company * c, size_t & index) const {
-    Reg::Company::CompareId cmp;
+bool Reg::bSearchId(const string_view taxID, size_t & index) const {
     auto & list = mIds;
-    auto lower = lower_bound(list.begin(), list.end(), c, cmp);
+    auto lower = partition_point(list.begin(), list.end(), [&](const Handle h) {
+        return mPool.getId(h) < taxID;
+    });
     index = distance(list.begin(), lower);
     if (lower == list.end()) return false;
-    return !cmp(*lower, c) && !cmp(c, *lower);
+    return mPool.getId(*lower) == taxID;
 }
 
 
-void Reg::Company::addAmount(unsigned int amount) { mAmount += amount; }
-const string & Reg::Company::getName() const { return mName; }
-const string & Reg::Company::getAddr() const { return mAddr; }
-unsigned int Reg::Company::getAmount() const { return mAmount; }
+/** Stores the strings of a company, false if the arena would outgrow 32-bit offsets */
+bool Reg::CompanyPool::add(const string & name, const string & addr, const string & id, Handle & h) {
+    // FREE marks free records, so no offset may reach it
+    const size_t bytes = name.size() + addr.size() + id.size();
+    if (mArena.size() >= FREE || bytes >= FREE - mArena.size()) return false;
+    const Record record = {
+        (unsigned int) mArena.size(),
+        (unsigned int) name.size(),
+        (unsigned int) addr.size(),
+        (unsigned int) id.size() };
+    mArena.append(name).append(addr).append(id);
+    if (mFree.empty()) {
+        mRecords.push_back(record);
+        mAmounts.push_back(0);
+        h = mRecords.size() - 1;
+        return true;
+    }
+    h = mFree.back();
+    mFree.pop_back();
+    mRecords[h] = record;
+    mAmounts[h] = 0;
+    return true;
+}
+void Reg::CompanyPool::remove(const Handle h) {
+    Record & record = mRecords[h];
+    mDeadBytes += record.mNameLen + record.mAddrLen + record.mIdLen;
+    record.mOffset = FREE;
+    mFree.push_back(h);
+    if (mDeadBytes > mArena.size() / 2) compact();
+}
+/** Moves the strings of all the live records to a new arena */
+void Reg::CompanyPool::compact() {
+    string arena;
+    arena.reserve(mArena.size() - mDeadBytes);
+    for (auto & record : mRecords) {
+        if (record.mOffset == FREE) continue;
+        const size_t length = record.mNameLen + record.mAddrLen + record.mIdLen;
+        const unsigned int offset = arena.size();
+        arena.append(mArena, record.mOffset, length);
+        record.mOffset = offset;
+    }
+    mArena.swap(arena);
+    mDeadBytes = 0;
+}
 
+inline string_view Reg::CompanyPool::getName(const Handle h) const {
+    const Record & r = mRecords[h];
+    return string_view(mArena.data() + r.mOffset, r.mNameLen);
+}
+inline string_view Reg::CompanyPool::getAddr(const Handle h) const {
+    const Record & r = mRecords[h];
+    return string_view(mArena.data() + r.mOffset + r.mNameLen, r.mAddrLen);
+}
+inline string_view Reg::CompanyPool::getId(const Handle h) const {
+    const Record & r = mRecords[h];
+    return string_view(mArena.data() + r.mOffset + r.mNameLen + r.mAddrLen, r.mIdLen);
+}
+void Reg::CompanyPool::addAmount(const Handle h, const unsigned int amount) { mAmounts[h] += amount; }
+unsigned int Reg::CompanyPool::getAmount(const Handle h) const { return mAmounts[h]; }
+
+size_t Reg::CompanyPool::memoryUsage() const {
+    return mArena.capacity()
+        + mRecords.capacity() * sizeof(Record)
+        + mAmounts.capacity() * sizeof(unsigned int)
+        + mFree.capacity() * sizeof(Handle);
+}
+void Reg::CompanyPool::clear() {
+    mArena.clear();
+    mRecords.clear();
+    mAmounts.clear();
+    mFree.clear();
+    mDeadBytes = 0;
+}
 
-template <class Compare>
-unsigned int & Reg::PriorityQueue<Compare>::top() { return mData[0]; }
-template <class Compare>
-unsigned int Reg::PriorityQueue<Compare>::top() const { return mData[0]; }
 
-template <class Compare>
-Reg::PriorityQueue<Compare> & Reg::PriorityQueue<Compare>::push(const unsigned int item) {
+template <class Compare, class T, size_t Arity>
+T & Reg::PriorityQueue<Compare, T, Arity>::top() { return mData[0]; }
+template <class Compare, class T, size_t Arity>
+const T & Reg::PriorityQueue<Compare, T, Arity>::top() const { return mData[0]; }
+
+template <class Compare, class T, size_t Arity>
+Reg::PriorityQueue<Compare, T, Arity> & Reg::PriorityQueue<Compare, T, Arity>::push(const T & item) {
     mData.push_back(item);
-    repairChild();
+    repairChild(lastIndex());
     return *this;
 }
-template <class Compare>
-unsigned int Reg::PriorityQueue<Compare>::pop() {
-    const unsigned int topItem = top();
-    mData[0] = mData.back();
+template <class Compare, class T, size_t Arity>
+T Reg::PriorityQueue<Compare, T, Arity>::pop() {
+    T topItem = std::move(mData[0]);
+    if (size() > 1) mData[0] = std::move(mData.back());
     mData.pop_back();
-    repairTop();
+    if (!empty()) repairTop(0);
+    return topItem;
+}
+/** Same as pop() followed by push(item), but sifts only once */
+template <class Compare, class T, size_t Arity>
+T Reg::PriorityQueue<Compare, T, Arity>::replaceTop(const T & item) {
+    T topItem = std::move(mData[0]);
+    mData[0] = item;
+    repairTop(0);
     return topItem;
 }
+/** Adds all the items in the range and rebuilds the heap in O(n) */
+template <class Compare, class T, size_t Arity>
+template <class It>
+Reg::PriorityQueue<Compare, T, Arity> & Reg::PriorityQueue<Compare, T, Arity>::heapify(It first, It last) {
+    mData.insert(mData.end(), first, last);
+    if (size() < 2) return *this;
+    for (size_t i = parInd(lastIndex()) + 1; i-- > 0; )
+        repairTop(i);
+    return *this;
+}
+template <class Compare, class T, size_t Arity>
+void Reg::PriorityQueue<Compare, T, Arity>::reserve(const size_t capacity) { mData.reserve(capacity); }
 
-template <class Compare>
-inline void Reg::PriorityQueue<Compare>::repairTop() { repairTop(0); }
-template <class Compare>
-inline void Reg::PriorityQueue<Compare>::repairChild() { repairChild(lastIndex()); }
-
-template <class Compare>
-void Reg::PriorityQueue<Compare>::repairTop(const size_t topIndex) {
-    const size_t last = lastIndex();
-    const size_t left = leftInd(topIndex);
-    const size_t right = left + 1;
-
-    if (left > last) return;
-    const size_t maxChild =
-        (right <= last && mCmp(mData[left], mData[right])) ? right : left;
-    /*cout << "top " << topIndex
-      << " left " << left
-      << " right " << right
-      << " max " << maxChild
-      << " last " << last << endl;*/
-    if (mCmp(mData[topIndex], mData[maxChild])) {
-        swapItems(topIndex, maxChild);
-        repairTop(maxChild);
-    }
-}
-template <class Compare>
-void Reg::PriorityQueue<Compare>::repairChild(const size_t childIndex) {
-    if (childIndex == 0) return;   
-    size_t parent = parInd(childIndex);
-
-    if(mCmp(mData[parent], mData[childIndex])) {
-        swapItems(parent, childIndex);
-        repairChild(parent);
-    }
-}
-template <class Compare>
-void Reg::PriorityQueue<Compare>::swapItems(const size_t i1, const size_t i2) {
-    unsigned int tmp = mData[i1];
-    mData[i1] = mData[i2];
-    mData[i2] = tmp;
-}
-
-template <class Compare>
-inline size_t Reg::PriorityQueue<Compare>::parInd(const size_t index) const { return (index - 1) / 2; }
-template <class Compare>
-inline size_t Reg::PriorityQueue<Compare>::leftInd(const size_t index) const { return index * 2 + 1; }
-template <class Compare>
-inline size_t Reg::PriorityQueue<Compare>::rightInd(const size_t index) const { return leftInd(index) + 1; }
-
-template <class Compare>
-size_t Reg::PriorityQueue<Compare>::size() const { return mData.size(); }
-template <class Compare>
-inline size_t Reg::PriorityQueue<Compare>::lastIndex() const {
+/** Moves the hole down instead of swapping, item is written only once */
+template <class Compare, class T, size_t Arity>
+void Reg::PriorityQueue<Compare, T, Arity>::repairTop(size_t topIndex) {
+    const size_t count = size();
+    T item = std::move(mData[topIndex]);
+    while (true) {
+        const size_t first = childInd(topIndex);
+        if (first >= count) break;
+        const size_t last = min(first + Arity, count);
+        size_t maxChild = first;
+        for (size_t i = first + 1; i < last; i++)
+            if (mCmp(mData[maxChild], mData[i])) maxChild = i;
+        if (!mCmp(item, mData[maxChild])) break;
+        mData[topIndex] = std::move(mData[maxChild]);
+        topIndex = maxChild;
+    }
+    mData[topIndex] = std::move(item);
+}
+template <class Compare, class T, size_t Arity>
+void Reg::PriorityQueue<Compare, T, Arity>::repairChild(size_t childIndex) {
+    T item = std::move(mData[childIndex]);
+    while (childIndex > 0) {
+        const size_t parent = parInd(childIndex);
+        if (!mCmp(mData[parent], item)) break;
+        mData[childIndex] = std::move(mData[parent]);
+        childIndex = parent;
+    }
+    mData[childIndex] = std::move(item);
+}
+
+template <class Compare, class T, size_t Arity>
+inline size_t Reg::PriorityQueue<Compare, T, Arity>::parInd(const size_t index) const { return (index - 1) / Arity; }
+template <class Compare, class T, size_t Arity>
+inline size_t Reg::PriorityQueue<Compare, T, Arity>::childInd(const size_t index) const { return index * Arity + 1; }
+
+template <class Compare, class T, size_t Arity>
+size_t Reg::PriorityQueue<Compare, T, Arity>::size() const { return mData.size(); }
+template <class Compare, class T, size_t Arity>
+inline size_t Reg::PriorityQueue<Compare, T, Arity>::lastIndex() const {
     const size_t s = size();
     return s == 0 ? 0 : s - 1;
 }
-template <class Compare>
-inline bool Reg::PriorityQueue<Compare>::empty() const { return size() == 0; }
-template <class Compare>
-void Reg::PriorityQueue<Compare>::clear() {
+template <class Compare, class T, size_t Arity>
+inline bool Reg::PriorityQueue<Compare, T, Arity>::empty() const { return size() == 0; }
+template <class Compare, class T, size_t Arity>
+void Reg::PriorityQueue<Compare, T, Arity>::clear() {
     mData.clear();
 }
 
 
-
-void Reg::Company::print(ostream & out = cout) const {
-    out << "[" << mName << ", " << mAddr << ", " << mId << ", " << mAmount << "]";
+void Reg::CompanyPool::print(const Handle h, ostream & out = cout) const {
+    out << "[" << getName(h) << ", " << getAddr(h) << ", " << getId(h) << ", " << getAmount(h) << "]";
 }
-template <class Compare>
-void Reg::PriorityQueue<Compare>::print(ostream & out) const {
+template <class Compare, class T, size_t Arity>
+void Reg::PriorityQueue<Compare, T, Arity>::print(ostream & out) const {
     out << "Queue has " << mData.size() << " items" << endl;
     for (auto & item : mData)
         out << item << ", ";
     out << endl;
 }
+
 void Reg::printList(ostream & out = cout) const {
     out << "List: Total of " << mList.size() << " items" << endl;
     for (size_t i = 0; i < mList.size(); i++) {
         out << i << ". ";
-        mList[i] -> print(out);
+        mPool.print(mList[i], out);
         out << "\n";
     }
     out.flush();
@@ -387,16 +575,729 @@ void Reg::printIds(ostream & out = cout) const {
     out << "IDs: Total of " << mIds.size() << " items" << endl;
     for (size_t i = 0; i < mIds.size(); i++) {
         out << i << ". ";
-        mIds[i] -> print(out);
+        mPool.print(mIds[i], out);
         out << "\n";
     }
     out.flush();
 }
 
 #ifndef __PROGTEST__
+/**
+ * Thread safe variant of CVATRegister, not a part of the ProgTest submission
+ * Companies are sharded by a hash of their tax ID, each shard has its own
+ * reader/writer lock. The name index is shared by all the shards and
+ * is always locked before a shard. Invoices only take shared locks,
+ * amounts are updated atomically and invoice amounts are buffered
+ * per thread and merged into the median heaps lazily.
+ * Each call sees a consistent state of the register. A walk by firstCompany()
+ * and nextCompany() does not, companies added or cancelled during it may be
+ * seen or skipped. The name list is copied on write, so snapshot() can give
+ * a walk over the state of one moment.
+ */
+class CConcurrentVATRegister {
+        struct Company;
+        typedef vector<shared_ptr<Company>> CompanyList;
+    public:
+        /** Companies of the register at the moment snapshot() was called */
+        class Snapshot {
+            public:
+                bool firstCompany ( string & name, string & addr ) const;
+                bool nextCompany ( string & name, string & addr ) const;
+            private:
+                friend class CConcurrentVATRegister;
+                explicit Snapshot(shared_ptr<const CompanyList> list): mList(move(list)) {}
+                shared_ptr<const CompanyList> mList;
+        };
+
+        CConcurrentVATRegister ( void );
+        ~CConcurrentVATRegister ( void );
+
+        bool newCompany ( const string & name, const string & addr, const string & taxID );
+
+        bool cancelCompany ( const string & name, const string & addr );
+        bool cancelCompany ( const string & taxID );
+
+        bool invoice ( const string & name, const string & addr, unsigned int amount );
+        bool invoice ( const string & taxID, unsigned int amount );
+
+        bool audit ( const string & name, const string & addr, unsigned int & sumIncome ) const;
+        bool audit ( const string & taxID, unsigned int & sumIncome ) const;
+
+        unsigned int medianInvoice ( void ) const;
+
+        bool firstCompany ( string & name, string & addr ) const;
+        bool nextCompany ( string & name, string & addr ) const;
+        Snapshot snapshot ( void ) const;
+
+    private:
+        struct Company {
+            const string mName;
+            const string mAddr;
+            const string mId;
+            atomic<unsigned int> mAmount;
+
+            Company(const string & name, const string & addr, const string & id)
+                : mName(name), mAddr(addr), mId(id), mAmount(0) {}
+        };
+        struct Shard {
+            mutable shared_mutex mLock;
+            vector<Company*> mIds;
+        };
+        struct InvoiceBuffer {
+            mutex mLock;
+            vector<unsigned int> mData;
+        };
+
+        static const size_t SHARD_COUNT = 16;
+        static const size_t BUFFER_COUNT = 16;
+        static const size_t BUFFER_LIMIT = 1024;
+
+        mutable shared_mutex mNamesLock;
+        // changed in place, or replaced by a changed copy while a snapshot holds it
+        shared_ptr<CompanyList> mList;
+        Shard mShards[SHARD_COUNT];
+
+        mutable mutex mMedianLock;
+        mutable Reg::MedianTracker mInvoices;
+        mutable InvoiceBuffer mBuffers[BUFFER_COUNT];
+
+        Shard & shardOf(const string & taxID);
+        const Shard & shardOf(const string & taxID) const;
+        void addInvoice(const unsigned int amount);
+        void mergeInvoices() const;
+        CompanyList & writableList();
+        static bool bSearchName(const CompanyList & list, const string & name, const string & addr, size_t & index);
+        static bool nextInList(const CompanyList & list, string & name, string & addr);
+        static bool bSearchId(const Shard & shard, const string & taxID, size_t & index);
+};
+
+typedef CConcurrentVATRegister CReg;
+
+CReg::CConcurrentVATRegister(void): mList(make_shared<CompanyList>()) {}
+CReg::~CConcurrentVATRegister(void) {}
+
+bool CReg::newCompany ( const string & name, const string & addr, const string & taxID ) {
+    unique_lock<shared_mutex> namesLock(mNamesLock);
+    Shard & shard = shardOf(taxID);
+    unique_lock<shared_mutex> shardLock(shard.mLock);
+
+    size_t indexName, indexId;
+    if (bSearchName(*mList, name, addr, indexName) || bSearchId(shard, taxID, indexId))
+        return false;
+    auto c = make_shared<Company>(name, addr, taxID);
+    CompanyList & list = writableList();
+    list.insert(list.begin() + indexName, c);
+    shard.mIds.insert(shard.mIds.begin() + indexId, c.get());
+    return true;
+}
+
+bool CReg::cancelCompany ( const string & name, const string & addr ) {
+    unique_lock<shared_mutex> namesLock(mNamesLock);
+    size_t indexName, indexId;
+    if (!bSearchName(*mList, name, addr, indexName)) return false;
+
+    const Company * toDelete = (*mList)[indexName].get();
+    Shard & shard = shardOf(toDelete -> mId);
+    unique_lock<shared_mutex> shardLock(shard.mLock);
+    bSearchId(shard, toDelete -> mId, indexId);
+    shard.mIds.erase(shard.mIds.begin() + indexId);
+    // the company itself lives until the last snapshot holding it is gone
+    CompanyList & list = writableList();
+    list.erase(list.begin() + indexName);
+    return true;
+}
+bool CReg::cancelCompany ( const string & taxID ) {
+    unique_lock<shared_mutex> namesLock(mNamesLock);
+    Shard & shard = shardOf(taxID);
+    unique_lock<shared_mutex> shardLock(shard.mLock);
+    size_t indexName, indexId;
+    if (!bSearchId(shard, taxID, indexId)) return false;
+
+    const Company * toDelete = shard.mIds[indexId];
+    bSearchName(*mList, toDelete -> mName, toDelete -> mAddr, indexName);
+    shard.mIds.erase(shard.mIds.begin() + indexId);
+    CompanyList & list = writableList();
+    list.erase(list.begin() + indexName);
+    return true;
+}
+
+bool CReg::invoice ( const string & name, const string & addr, unsigned int amount ) {
+    {
+        shared_lock<shared_mutex> namesLock(mNamesLock);
+        size_t indexName;
+        if (!bSearchName(*mList, name, addr, indexName)) return false;
+        (*mList)[indexName] -> mAmount.fetch_add(amount, memory_order_relaxed);
+    }
+    addInvoice(amount);
+    return true;
+}
+bool CReg::invoice ( const string & taxID, unsigned int amount ) {
+    {
+        const Shard & shard = shardOf(taxID);
+        shared_lock<shared_mutex> shardLock(shard.mLock);
+        size_t indexId;
+        if (!bSearchId(shard, taxID, indexId)) return false;
+        shard.mIds[indexId] -> mAmount.fetch_add(amount, memory_order_relaxed);
+    }
+    addInvoice(amount);
+    return true;
+}
+
+bool CReg::audit ( const string & name, const string & addr, unsigned int & sumIncome ) const {
+    shared_lock<shared_mutex> namesLock(mNamesLock);
+    size_t indexName;
+    if (!bSearchName(*mList, name, addr, indexName)) return false;
+    sumIncome = (*mList)[indexName] -> mAmount.load(memory_order_relaxed);
+    return true;
+}
+bool CReg::audit ( const string & taxID, unsigned int & sumIncome ) const {
+    const Shard & shard = shardOf(taxID);
+    shared_lock<shared_mutex> shardLock(shard.mLock);
+    size_t indexId;
+    if (!bSearchId(shard, taxID, indexId)) return false;
+    sumIncome = shard.mIds[indexId] -> mAmount.load(memory_order_relaxed);
+    return true;
+}
+
+unsigned int CReg::medianInvoice ( void ) const {
+    lock_guard<mutex> medianLock(mMedianLock);
+    mergeInvoices();
+    return mInvoices.median();
+}
+
+bool CReg::firstCompany ( string & name, string & addr ) const {
+    shared_lock<shared_mutex> namesLock(mNamesLock);
+    if (mList -> empty()) return false;
+    name = mList -> front() -> mName;
+    addr = mList -> front() -> mAddr;
+    return true;
+}
+/** Returns the company following the given one even if that one has been cancelled meanwhile */
+bool CReg::nextCompany ( string & name, string & addr ) const {
+    shared_lock<shared_mutex> namesLock(mNamesLock);
+    return nextInList(*mList, name, addr);
+}
+CReg::Snapshot CReg::snapshot ( void ) const {
+    shared_lock<shared_mutex> namesLock(mNamesLock);
+    return Snapshot(mList);
+}
+bool CReg::Snapshot::firstCompany ( string & name, string & addr ) const {
+    if (mList -> empty()) return false;
+    name = mList -> front() -> mName;
+    addr = mList -> front() -> mAddr;
+    return true;
+}
+bool CReg::Snapshot::nextCompany ( string & name, string & addr ) const {
+    return nextInList(*mList, name, addr);
+}
+
+/**
+ * The name list to change, the caller holds mNamesLock exclusively, so no
+ * snapshot can be taken meanwhile. The list is copied only if one holds it.
+ */
+CReg::CompanyList & CReg::writableList() {
+    if (mList.use_count() == 1) {
+        // the last snapshot may have been dropped right now, its reads come first
+        atomic_thread_fence(memory_order_acquire);
+        return *mList;
+    }
+    mList = make_shared<CompanyList>(*mList);
+    return *mList;
+}
+
+/** Buffers the amount in the calling thread's buffer, full buffers are merged right away */
+void CReg::addInvoice(const unsigned int amount) {
+    const size_t bufferIndex = hash<thread::id>()(this_thread::get_id()) % BUFFER_COUNT;
+    InvoiceBuffer & buffer = mBuffers[bufferIndex];
+    vector<unsigned int> full;
+    {
+        lock_guard<mutex> bufferLock(buffer.mLock);
+        buffer.mData.push_back(amount);
+        if (buffer.mData.size() < BUFFER_LIMIT) return;
+        full.swap(buffer.mData);
+    }
+    lock_guard<mutex> medianLock(mMedianLock);
+    for (auto item : full) mInvoices.add(item);
+}
+/** Moves all the buffered amounts into the median tracker, mMedianLock has to be held */
+void CReg::mergeInvoices() const {
+    vector<unsigned int> pending;
+    for (auto & buffer : mBuffers) {
+        {
+            lock_guard<mutex> bufferLock(buffer.mLock);
+            pending.swap(buffer.mData);
+        }
+        for (auto item : pending) mInvoices.add(item);
+        pending.clear();
+    }
+}
+
+CReg::Shard & CReg::shardOf(const string & taxID) {
+    return mShards[hash<string>()(taxID) % SHARD_COUNT];
+}
+const CReg::Shard & CReg::shardOf(const string & taxID) const {
+    return mShards[hash<string>()(taxID) % SHARD_COUNT];
+}
+
+bool CReg::bSearchName(const CompanyList & list, const string & name, const string & addr, size_t & index) {
+    Reg::CompareNameAddr cmp;
+    auto lower = lower_bound(list.begin(), list.end(), nullptr,
+            [&](const shared_ptr<Company> & c, nullptr_t) {
+                if (cmp(c -> mName, name)) return true;
+                if (cmp(name, c -> mName)) return false;
+                return cmp(c -> mAddr, addr);
+            });
+    index = distance(list.begin(), lower);
+    if (lower == list.end()) return false;
+    return !cmp(name, (*lower) -> mName) && !cmp(addr, (*lower) -> mAddr);
+}
+/** Moves name and addr to the following company in the list, they need not be in it */
+bool CReg::nextInList(const CompanyList & list, string & name, string & addr) {
+    size_t indexName;
+    if (bSearchName(list, name, addr, indexName)) indexName++;
+    if (indexName >= list.size()) return false;
+    name = list[indexName] -> mName;
+    addr = list[indexName] -> mAddr;
+    return true;
+}
+bool CReg::bSearchId(const Shard & shard, const string & taxID, size_t & index) {
+    auto & list = shard.mIds;
+    auto lower = lower_bound(list.begin(), list.end(), taxID,
+            [](const Company * c, const string & id) { return c -> mId < id; });
+    index = distance(list.begin(), lower);
+    if (lower == list.end()) return false;
+    return (*lower) -> mId == taxID;
+}
+#endif /* __PROGTEST__ */
+
+#ifndef __PROGTEST__
+/**
+ * CVATRegister which survives restarts, not a part of the ProgTest submission
+ *
+ * The state is kept in a snapshot and an append-only operation log.
+ * The snapshot is a header followed by raw copies of all the register arrays,
+ * it is written sequentially and loaded by mapping the file and copying each
+ * array at once. Companies are referenced by handles, so nothing has to be
+ * fixed up, parsed or sorted on load. Every successful modification is then
+ * appended to the log and replayed on the next open.
+ *
+ * Both files carry a generation number, checkpoint() writes a snapshot
+ * of the next generation and only then starts a new log, so a crash
+ * in between leaves a stale log which is ignored.
+ *
+ * Modifications fail while there is no log open. When a log write fails,
+ * the record is cut off and the state is loaded from the files again,
+ * so the register never holds a change which is not logged.
+ */
+class CPersistentVATRegister {
+    public:
+        CPersistentVATRegister ( void );
+        ~CPersistentVATRegister ( void );
+
+        bool open ( const string & snapshotFile, const string & logFile );
+        bool checkpoint ( void );
+        void close ( void );
+
+        bool newCompany ( const string & name, const string & addr, const string & taxID );
+
+        bool cancelCompany ( const string & name, const string & addr );
+        bool cancelCompany ( const string & taxID );
+
+        bool invoice ( const string & name, const string & addr, unsigned int amount );
+        bool invoice ( const string & taxID, unsigned int amount );
+
+        bool audit ( const string & name, const string & addr, unsigned int & sumIncome ) const;
+        bool audit ( const string & taxID, unsigned int & sumIncome ) const;
+
+        unsigned int medianInvoice ( void ) const;
+
+        bool firstCompany ( string & name, string & addr ) const;
+        bool nextCompany ( string & name, string & addr ) const;
+
+    private:
+        enum Section {
+            ARENA, RECORDS, AMOUNTS, FREE, LIST, IDS, SMALLER, GREATER, SECTION_COUNT
+        };
+        struct SnapshotHeader {
+            char mMagic[8];
+            uint64_t mGeneration;
+            uint64_t mDeadBytes;
+            uint64_t mSizes[SECTION_COUNT];
+        };
+        enum Operation : uint32_t {
+            NEW_COMPANY, CANCEL_NAME, CANCEL_ID, INVOICE_NAME, INVOICE_ID
+        };
+        struct LogHeader {
+            char mMagic[8];
+            uint64_t mGeneration;
+        };
+        struct LogRecord {
+            uint32_t mOp;
+            uint32_t mAmount;
+            uint32_t mLens[3];
+        };
+
+        CVATRegister mReg;
+        string mSnapshotFile;
+        string mLogFile;
+        FILE * mLog = nullptr;
+        uint64_t mGeneration = 0;
+
+        bool saveSnapshot(const uint64_t generation) const;
+        bool loadSnapshot();
+        bool validState() const;
+        bool createLog(const uint64_t generation);
+        bool replayLog();
+        bool appendLog(const Operation op, const unsigned int amount,
+                const string & s1, const string & s2 = "", const string & s3 = "");
+        void applyRecord(const LogRecord & record, const string * strings);
+        void rollback(const long logEnd);
+        void clearState();
+        static size_t padding(const size_t bytes);
+        template <class T>
+        static bool loadSection(vector<T> & dst, const char * src, const uint64_t bytes);
+        static bool loadSection(string & dst, const char * src, const uint64_t bytes);
+};
+
+typedef CPersistentVATRegister PReg;
+
+static const char SNAPSHOT_MAGIC[8] = { 'V', 'A', 'T', 'S', 'N', 'A', 'P', '1' };
+static const char LOG_MAGIC[8] = { 'V', 'A', 'T', 'L', 'O', 'G', '0', '1' };
+
+PReg::CPersistentVATRegister(void) {}
+PReg::~CPersistentVATRegister(void) { close(); }
+
+/**
+ * Loads the snapshot if there is one and replays the log on top of it
+ * Returns false if the files are corrupted or do not belong together
+ */
+bool PReg::open(const string & snapshotFile, const string & logFile) {
+    close();
+    mSnapshotFile = snapshotFile;
+    mLogFile = logFile;
+    mGeneration = 0;
+
+    struct stat st;
+    if (stat(mSnapshotFile.c_str(), &st) == 0 && !loadSnapshot()) return false;
+    if (!replayLog()) {
+        clearState();
+        return false;
+    }
+    mLog = fopen(mLogFile.c_str(), "ab");
+    return mLog != nullptr;
+}
+/** Saves the whole state and starts a new empty log */
+bool PReg::checkpoint() {
+    if (mLog == nullptr) return false;
+    if (!saveSnapshot(mGeneration + 1)) return false;
+    mGeneration++;
+    fclose(mLog);
+    mLog = nullptr;
+    if (!createLog(mGeneration)) return false;
+    mLog = fopen(mLogFile.c_str(), "ab");
+    return mLog != nullptr;
+}
+/** Closes the log, the register is emptied until the next open() */
+void PReg::close() {
+    if (mLog != nullptr) fclose(mLog);
+    mLog = nullptr;
+    clearState();
+}
+void PReg::clearState() {
+    mReg.mPool.clear();
+    mReg.mList.clear();
+    mReg.mIds.clear();
+    mReg.mInvoices.clear();
+}
+
+bool PReg::newCompany ( const string & name, const string & addr, const string & taxID ) {
+    return mLog != nullptr && mReg.newCompany(name, addr, taxID)
+        && appendLog(NEW_COMPANY, 0, name, addr, taxID);
+}
+bool PReg::cancelCompany ( const string & name, const string & addr ) {
+    return mLog != nullptr && mReg.cancelCompany(name, addr)
+        && appendLog(CANCEL_NAME, 0, name, addr);
+}
+bool PReg::cancelCompany ( const string & taxID ) {
+    return mLog != nullptr && mReg.cancelCompany(taxID)
+        && appendLog(CANCEL_ID, 0, taxID);
+}
+bool PReg::invoice ( const string & name, const string & addr, unsigned int amount ) {
+    return mLog != nullptr && mReg.invoice(name, addr, amount)
+        && appendLog(INVOICE_NAME, amount, name, addr);
+}
+bool PReg::invoice ( const string & taxID, unsigned int amount ) {
+    return mLog != nullptr && mReg.invoice(taxID, amount)
+        && appendLog(INVOICE_ID, amount, taxID);
+}
+bool PReg::audit ( const string & name, const string & addr, unsigned int & sumIncome ) const {
+    return mReg.audit(name, addr, sumIncome);
+}
+bool PReg::audit ( const string & taxID, unsigned int & sumIncome ) const {
+    return mReg.audit(taxID, sumIncome);
+}
+unsigned int PReg::medianInvoice ( void ) const { return mReg.medianInvoice(); }
+bool PReg::firstCompany ( string & name, string & addr ) const { return mReg.firstCompany(name, addr); }
+bool PReg::nextCompany ( string & name, string & addr ) const { return mReg.nextCompany(name, addr); }
+
+inline size_t PReg::padding(const size_t bytes) { return (8 - bytes % 8) % 8; }
+
+/** Writes the snapshot into a temporary file and renames it over the old one */
+bool PReg::saveSnapshot(const uint64_t generation) const {
+    const Reg::CompanyPool & pool = mReg.mPool;
+    const struct { const void * mData; uint64_t mBytes; } sections[SECTION_COUNT] = {
+        { pool.mArena.data(), pool.mArena.size() },
+        { pool.mRecords.data(), pool.mRecords.size() * sizeof(pool.mRecords[0]) },
+        { pool.mAmounts.data(), pool.mAmounts.size() * sizeof(unsigned int) },
+        { pool.mFree.data(), pool.mFree.size() * sizeof(Reg::Handle) },
+        { mReg.mList.data(), mReg.mList.size() * sizeof(Reg::Handle) },
+        { mReg.mIds.data(), mReg.mIds.size() * sizeof(Reg::Handle) },
+        { mReg.mInvoices.mSmaller.mData.data(), mReg.mInvoices.mSmaller.size() * sizeof(unsigned int) },
+        { mReg.mInvoices.mGreater.mData.data(), mReg.mInvoices.mGreater.size() * sizeof(unsigned int) },
+    };
+    SnapshotHeader header;
+    memcpy(header.mMagic, SNAPSHOT_MAGIC, sizeof(header.mMagic));
+    header.mGeneration = generation;
+    header.mDeadBytes = pool.mDeadBytes;
+    for (int i = 0; i < SECTION_COUNT; i++) header.mSizes[i] = sections[i].mBytes;
+
+    const string tmpFile = mSnapshotFile + ".tmp";
+    FILE * f = fopen(tmpFile.c_str(), "wb");
+    if (f == nullptr) return false;
+    const char zeros[8] = {};
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (int i = 0; ok && i < SECTION_COUNT; i++) {
+        const size_t pad = padding(sections[i].mBytes);
+        // an empty section may have no data pointer at all
+        ok = (sections[i].mBytes == 0
+                || fwrite(sections[i].mData, 1, sections[i].mBytes, f) == sections[i].mBytes)
+            && fwrite(zeros, 1, pad, f) == pad;
+    }
+    ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+    if (ok) ok = rename(tmpFile.c_str(), mSnapshotFile.c_str()) == 0;
+    if (!ok) remove(tmpFile.c_str());
+    return ok;
+}
+
+template <class T>
+bool PReg::loadSection(vector<T> & dst, const char * src, const uint64_t bytes) {
+    if (bytes % sizeof(T) != 0) return false;
+    dst.resize(bytes / sizeof(T));
+    if (bytes != 0) memcpy((void *) dst.data(), src, bytes);
+    return true;
+}
+bool PReg::loadSection(string & dst, const char * src, const uint64_t bytes) {
+    dst.assign(src, bytes);
+    return true;
+}
+
+/** Maps the snapshot file and copies every array out of it at once */
+bool PReg::loadSnapshot() {
+    const int fd = ::open(mSnapshotFile.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+        ::close(fd);
+        return false;
+    }
+    const size_t fileSize = st.st_size;
+    void * mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) return false;
+    const char * data = (const char *) mapped;
+
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    size_t offsets[SECTION_COUNT];
+    size_t offset = sizeof(header);
+    bool fits = true;
+    for (int i = 0; fits && i < SECTION_COUNT; i++) {
+        offsets[i] = offset;
+        // compared to the bytes left, so the sizes can not wrap the sum
+        const uint64_t bytes = header.mSizes[i];
+        fits = bytes <= fileSize - offset && padding(bytes) <= fileSize - offset - bytes;
+        if (fits) offset += bytes + padding(bytes);
+    }
+    Reg::CompanyPool & pool = mReg.mPool;
+    bool ok = memcmp(header.mMagic, SNAPSHOT_MAGIC, sizeof(header.mMagic)) == 0
+        && fits && offset == fileSize
+        && header.mSizes[LIST] == header.mSizes[IDS]
+        && loadSection(pool.mArena, data + offsets[ARENA], header.mSizes[ARENA])
+        && loadSection(pool.mRecords, data + offsets[RECORDS], header.mSizes[RECORDS])
+        && loadSection(pool.mAmounts, data + offsets[AMOUNTS], header.mSizes[AMOUNTS])
+        && loadSection(pool.mFree, data + offsets[FREE], header.mSizes[FREE])
+        && loadSection(mReg.mList, data + offsets[LIST], header.mSizes[LIST])
+        && loadSection(mReg.mIds, data + offsets[IDS], header.mSizes[IDS])
+        && loadSection(mReg.mInvoices.mSmaller.mData, data + offsets[SMALLER], header.mSizes[SMALLER])
+        && loadSection(mReg.mInvoices.mGreater.mData, data + offsets[GREATER], header.mSizes[GREATER]);
+    munmap(mapped, fileSize);
+    pool.mDeadBytes = header.mDeadBytes;
+    if (!ok || !validState()) {
+        clearState();
+        return false;
+    }
+    mGeneration = header.mGeneration;
+    return true;
+}
+
+/**
+ * Checks the loaded arrays can be used without reading out of them
+ * Handles and free entries have to refer to records, records to the arena,
+ * both lists have to hold every live company once in the right order
+ */
+bool PReg::validState() const {
+    const Reg::CompanyPool & pool = mReg.mPool;
+    const size_t records = pool.mRecords.size();
+    if (pool.mAmounts.size() != records || pool.mDeadBytes > pool.mArena.size()) return false;
+    size_t live = 0;
+    for (const auto & record : pool.mRecords) {
+        if (record.mOffset == Reg::CompanyPool::FREE) continue;
+        const uint64_t end = (uint64_t) record.mOffset + record.mNameLen + record.mAddrLen + record.mIdLen;
+        if (end > pool.mArena.size()) return false;
+        live++;
+    }
+    vector<bool> seen(records, false);
+    for (const Reg::Handle h : pool.mFree) {
+        if (h >= records || seen[h] || pool.mRecords[h].mOffset != Reg::CompanyPool::FREE) return false;
+        seen[h] = true;
+    }
+    if (live + pool.mFree.size() != records) return false;
+    if (mReg.mList.size() != live || mReg.mIds.size() != live) return false;
+    for (const Reg::Handle h : mReg.mList)
+        if (h >= records || pool.mRecords[h].mOffset == Reg::CompanyPool::FREE) return false;
+    for (const Reg::Handle h : mReg.mIds)
+        if (h >= records || pool.mRecords[h].mOffset == Reg::CompanyPool::FREE) return false;
+    // strictly ascending lists cannot hold a company twice
+    Reg::CompareNameAddr cmp;
+    for (size_t i = 1; i < live; i++) {
+        const Reg::Handle a = mReg.mList[i - 1], b = mReg.mList[i];
+        if (cmp.compare(pool.getName(a), pool.getAddr(a), pool.getName(b), pool.getAddr(b)) >= 0)
+            return false;
+        if (!(pool.getId(mReg.mIds[i - 1]) < pool.getId(mReg.mIds[i]))) return false;
+    }
+    const size_t smaller = mReg.mInvoices.mSmaller.size(), greater = mReg.mInvoices.mGreater.size();
+    return greater == smaller || greater == smaller + 1;
+}
+
+bool PReg::createLog(const uint64_t generation) {
+    LogHeader header;
+    memcpy(header.mMagic, LOG_MAGIC, sizeof(header.mMagic));
+    header.mGeneration = generation;
+    const string tmpFile = mLogFile + ".tmp";
+    FILE * f = fopen(tmpFile.c_str(), "wb");
+    if (f == nullptr) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+    ok = fclose(f) == 0 && ok;
+    if (ok) ok = rename(tmpFile.c_str(), mLogFile.c_str()) == 0;
+    if (!ok) remove(tmpFile.c_str());
+    return ok;
+}
+
+/**
+ * Applies all the log records of the current generation
+ * A torn record at the end of the log is cut off, a log of an older
+ * generation is already contained in the snapshot and gets replaced
+ */
+bool PReg::replayLog() {
+    FILE * f = fopen(mLogFile.c_str(), "rb");
+    if (f == nullptr) return createLog(mGeneration);
+
+    LogHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1
+            || memcmp(header.mMagic, LOG_MAGIC, sizeof(header.mMagic)) != 0) {
+        fclose(f);
+        return false;
+    }
+    if (header.mGeneration < mGeneration) {
+        fclose(f);
+        return createLog(mGeneration);
+    }
+    if (header.mGeneration > mGeneration) {
+        fclose(f);
+        return false;
+    }
+
+    long validEnd = ftell(f);
+    LogRecord record;
+    string strings[3];
+    while (fread(&record, sizeof(record), 1, f) == 1) {
+        bool complete = record.mOp <= INVOICE_ID;
+        for (int i = 0; complete && i < 3; i++) {
+            strings[i].resize(record.mLens[i]);
+            complete = fread(&strings[i][0], 1, record.mLens[i], f) == record.mLens[i];
+        }
+        if (!complete) break;
+        applyRecord(record, strings);
+        validEnd = ftell(f);
+    }
+    fclose(f);
+    return truncate(mLogFile.c_str(), validEnd) == 0;
+}
+void PReg::applyRecord(const LogRecord & record, const string * strings) {
+    switch (record.mOp) {
+        case NEW_COMPANY:  mReg.newCompany(strings[0], strings[1], strings[2]); break;
+        case CANCEL_NAME:  mReg.cancelCompany(strings[0], strings[1]); break;
+        case CANCEL_ID:    mReg.cancelCompany(strings[0]); break;
+        case INVOICE_NAME: mReg.invoice(strings[0], strings[1], record.mAmount); break;
+        case INVOICE_ID:   mReg.invoice(strings[0], record.mAmount); break;
+    }
+}
+/**
+ * Operations are logged only once they succeeded, so a replay repeats them exactly
+ * Returns false and rolls the operation back if the record cannot be written
+ */
+bool PReg::appendLog(const Operation op, const unsigned int amount,
+        const string & s1, const string & s2, const string & s3) {
+    if (mLog == nullptr) return false;
+    const long logEnd = ftell(mLog);
+    const LogRecord record = { op, amount,
+        { (uint32_t) s1.size(), (uint32_t) s2.size(), (uint32_t) s3.size() } };
+    const bool ok = logEnd >= 0
+        && fwrite(&record, sizeof(record), 1, mLog) == 1
+        && fwrite(s1.data(), 1, s1.size(), mLog) == s1.size()
+        && fwrite(s2.data(), 1, s2.size(), mLog) == s2.size()
+        && fwrite(s3.data(), 1, s3.size(), mLog) == s3.size()
+        && fflush(mLog) == 0;
+    if (!ok) rollback(logEnd);
+    return ok;
+}
+/** Cuts a partly written record off the log and loads the state the files hold */
+void PReg::rollback(const long logEnd) {
+    // closing may flush a part of the record, so the log is cut after it
+    fclose(mLog);
+    mLog = nullptr;
+    const string snapshotFile = mSnapshotFile, logFile = mLogFile;
+    if (logEnd < 0 || truncate(logFile.c_str(), logEnd) != 0) {
+        clearState();
+        return;
+    }
+    open(snapshotFile, logFile);
+}
+#endif /* __PROGTEST__ */
+
+#ifndef __PROGTEST__
+
+/** Char by char comparison the vectorized one has to agree with */
+int referenceCompare(const string & s1, const string & s2) {
+    auto normalizeChar = [](const char c) -> char {
+        return ('a' <= c && c <= 'z') ? c : c - ('A' - 'a');
+    };
+    size_t length = min(s1.length(), s2.length());
+    for (size_t i = 0; i < length; i++) {
+        char c1 = normalizeChar(s1[i]);
+        char c2 = normalizeChar(s2[i]);
+        if (c1 < c2) return -1;
+        else if (c1 > c2) return 1;
+    }
+    if (s1.length() < s2.length()) return -1;
+    if (s1.length() > s2.length()) return  1;
+    return 0;
+}
 
 void testCompare() {
-    Reg::Company::CompareNameAddr cmpNA;
+    Reg::CompareNameAddr cmpNA;
 
     assert( cmpNA("abc", "def"));
     assert(!cmpNA("def", "abc"));
@@ -411,6 +1312,34 @@ void testCompare() {
     assert( cmpNA("abc", "abcdef"));
     assert(!cmpNA("abcdef", "abc"));
 
+    // mismatches inside and after the vectorized blocks
+    const string base = "Some Very Long Company Name With Many Words, s.r.o.";
+    for (size_t i = 0; i < base.size(); i++) {
+        string upper = base, changed = base;
+        upper[i] = toupper(upper[i]);
+        changed[i] = '~';
+        assert(!cmpNA(base, upper) && !cmpNA(upper, base));
+        assert( referenceCompare(base, changed) == (cmpNA(base, changed) ? -1 : 1) );
+        assert( referenceCompare(changed, base) == (cmpNA(changed, base) ? -1 : 1) );
+    }
+    const char alphabet[] = "aAzZ@[`{09 .,\x80\xff";
+    unsigned int seed = 7;
+    for (int i = 0; i < 20000; i++) {
+        string s1, s2;
+        seed = seed * 1103515245 + 12345;
+        const size_t length = (seed >> 16) % 70;
+        for (size_t j = 0; j < length; j++) {
+            seed = seed * 1103515245 + 12345;
+            const char c = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+            s1 += c;
+            s2 += (seed >> 8) % 16 ? c : alphabet[(seed >> 20) % (sizeof(alphabet) - 1)];
+        }
+        if ((seed >> 4) % 4 == 0 && !s2.empty()) s2.pop_back();
+        const int ref = referenceCompare(s1, s2);
+        assert( cmpNA(s1, s2) == (ref < 0) );
+        assert( cmpNA(s2, s1) == (ref > 0) );
+    }
+
     cout << "PASSED: String comparison" << endl;
 }
 
@@ -447,9 +1376,392 @@ void testQueue() {
     for (auto c : data2) assert(c == q2.pop());
     assert( q2.empty() );
 
+    // binary heap, bulk build
+    vector<unsigned int> data3 = {4, 1, 10, 2, 5, 4, 3, 8, 0, 6, 7, 9, 11};
+    Reg::PriorityQueue<less<unsigned int>, unsigned int, 2> q3;
+    q3.reserve(data3.size());
+    q3.heapify(data3.begin(), data3.end());
+    assert( q3.size() == data3.size() );
+    assert( q3.top() == 11 );
+    assert( q3.replaceTop(3) == 11 );
+    assert( q3.replaceTop(12) == 10 );
+    assert( q3.top() == 12 );
+    data3.erase(find(data3.begin(), data3.end(), 11));
+    data3.erase(find(data3.begin(), data3.end(), 10));
+    data3.push_back(3);
+    data3.push_back(12);
+    sort(data3.begin(), data3.end(), greater<unsigned int>());
+    for (auto c : data3) assert(c == q3.pop());
+    assert( q3.empty() );
+
+    // heapify appends to existing items
+    Reg::PriorityQueue<greater<unsigned int>> q4;
+    q4.push(5).push(2);
+    vector<unsigned int> data4;
+    for (unsigned int i = 100; i > 0; i--) data4.push_back(i * 7 % 101);
+    q4.heapify(data4.begin(), data4.end());
+    data4.push_back(5);
+    data4.push_back(2);
+    sort(data4.begin(), data4.end());
+    for (auto c : data4) assert(c == q4.pop());
+    assert( q4.empty() );
+
     cout << "PASSED: Priority queue" << endl;
 }
 
+void testMedian() {
+    CVATRegister reg;
+    assert( reg.newCompany ( "ACME", "Kolejni", "1" ) );
+    vector<unsigned int> all;
+    unsigned int seed = 42;
+    for (int i = 0; i < 2000; i++) {
+        seed = seed * 1103515245 + 12345;
+        const unsigned int amount = (seed >> 16) % 500;
+        assert( reg.invoice ( "1", amount ) );
+        all.insert(upper_bound(all.begin(), all.end(), amount), amount);
+        assert( reg.medianInvoice () == all[all.size() / 2] );
+    }
+    cout << "PASSED: Median" << endl;
+}
+
+void testPool() {
+    CVATRegister reg;
+    unsigned int sumIncome;
+    string name, addr;
+    // cancelled handles are reused and the arena gets compacted
+    for (int round = 0; round < 5; round++) {
+        for (int i = 0; i < 100; i++)
+            assert( reg.newCompany ( "Company " + to_string(i), "Street " + to_string(round), to_string(i) ) );
+        for (int i = 0; i < 100; i += 2) {
+            assert( reg.invoice ( to_string(i), i ) );
+            assert( reg.cancelCompany ( "COMPANY " + to_string(i + 1), "street " + to_string(round) ) );
+        }
+        for (int i = 0; i < 100; i++) {
+            if (i % 2) assert(!reg.audit ( to_string(i), sumIncome ) );
+            else assert( reg.audit ( "Company " + to_string(i), "Street " + to_string(round), sumIncome ) && sumIncome == (unsigned int) i );
+        }
+        for (int i = 0; i < 100; i += 2)
+            assert( reg.cancelCompany ( to_string(i) ) );
+        assert(!reg.firstCompany ( name, addr ) );
+    }
+    assert( reg.newCompany ( "", "", "" ) );
+    assert( reg.firstCompany ( name, addr ) && name == "" && addr == "" );
+    assert( reg.audit ( "", sumIncome ) && sumIncome == 0 );
+    cout << "PASSED: Company pool" << endl;
+}
+
+/** Checks both registers hold the same companies in the same order */
+template <class A, class B>
+void assertSameRegisters(const A & a, const B & b) {
+    string nameA, addrA, nameB, addrB;
+    bool okA = a.firstCompany(nameA, addrA), okB = b.firstCompany(nameB, addrB);
+    while (okA && okB) {
+        unsigned int sumA, sumB;
+        assert( nameA == nameB && addrA == addrB );
+        assert( a.audit(nameA, addrA, sumA) && b.audit(nameB, addrB, sumB) && sumA == sumB );
+        okA = a.nextCompany(nameA, addrA);
+        okB = b.nextCompany(nameB, addrB);
+    }
+    assert( !okA && !okB );
+    assert( a.medianInvoice() == b.medianInvoice() );
+}
+
+/** Log writes fail once the file size limit is reached, checkpoint fails without the log directory */
+void testPersistentLogFailure(const string & snapshotFile, const string & logFile) {
+    remove(snapshotFile.c_str());
+    remove(logFile.c_str());
+    unsigned int sumIncome;
+    {
+        CPersistentVATRegister reg;
+        assert( reg.open(snapshotFile, logFile) );
+        assert( reg.newCompany("ACME", "Street", "1") && reg.invoice("1", 100) );
+
+        struct stat st;
+        assert( stat(logFile.c_str(), &st) == 0 );
+        rlimit oldLimit, limit;
+        getrlimit(RLIMIT_FSIZE, &oldLimit);
+        limit = oldLimit;
+        limit.rlim_cur = st.st_size + 10;
+        void (*oldHandler)(int) = signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &limit);
+        const bool added = reg.newCompany("Dummy", "Street", "2");
+        const bool invoiced = reg.invoice("1", 1000);
+        setrlimit(RLIMIT_FSIZE, &oldLimit);
+        signal(SIGXFSZ, oldHandler);
+        assert(!added && !invoiced );
+        // rolled back to the logged state, the log is usable again
+        assert(!reg.audit("2", sumIncome) );
+        assert( reg.audit("1", sumIncome) && sumIncome == 100 && reg.medianInvoice() == 100 );
+        assert( reg.invoice("1", 1) );
+    }
+    {
+        CPersistentVATRegister reg;
+        assert( reg.open(snapshotFile, logFile) );
+        assert(!reg.audit("2", sumIncome) );
+        assert( reg.audit("1", sumIncome) && sumIncome == 101 );
+    }
+    remove(snapshotFile.c_str());
+    remove(logFile.c_str());
+
+    const string dir = "test_logdir", dirLog = dir + "/" + logFile;
+    assert( mkdir(dir.c_str(), 0700) == 0 );
+    {
+        CPersistentVATRegister reg;
+        assert( reg.open(snapshotFile, dirLog) );
+        assert( reg.newCompany("ACME", "Street", "1") );
+        remove(dirLog.c_str());
+        rmdir(dir.c_str());
+        assert(!reg.checkpoint() );
+        assert(!reg.newCompany("Dummy", "Street", "2") && !reg.invoice("1", 10) );
+        assert( reg.audit("1", sumIncome) && sumIncome == 0 );
+    }
+    remove(snapshotFile.c_str());
+}
+
+/** Overwrites a 32-bit item of a snapshot section, the file keeps its size */
+void corruptSnapshot(const string & snapshotFile, const int section, const size_t index, const uint32_t value) {
+    FILE * f = fopen(snapshotFile.c_str(), "r+b");
+    assert( f );
+    // magic, generation, dead bytes, then the section sizes
+    uint64_t sizes[8];
+    assert( fseek(f, 24, SEEK_SET) == 0 && fread(sizes, sizeof(sizes), 1, f) == 1 );
+    uint64_t offset = 24 + sizeof(sizes);
+    for (int i = 0; i < section; i++) offset += (sizes[i] + 7) / 8 * 8;
+    assert( (index + 1) * sizeof(value) <= sizes[section] );
+    assert( fseek(f, offset + index * sizeof(value), SEEK_SET) == 0 );
+    assert( fwrite(&value, sizeof(value), 1, f) == 1 );
+    fclose(f);
+}
+
+/** Adds 2^63 to the sizes of the last two sections, their sum wraps to the same value */
+void wrapSnapshotSizes(const string & snapshotFile) {
+    FILE * f = fopen(snapshotFile.c_str(), "r+b");
+    assert( f );
+    uint64_t sizes[8];
+    assert( fseek(f, 24, SEEK_SET) == 0 && fread(sizes, sizeof(sizes), 1, f) == 1 );
+    sizes[6] += 1ULL << 63;
+    sizes[7] += 1ULL << 63;
+    assert( fseek(f, 24, SEEK_SET) == 0 && fwrite(sizes, sizeof(sizes), 1, f) == 1 );
+    fclose(f);
+}
+
+/** Snapshots of the right size with bad handles, offsets or section sizes are refused */
+void testCorruptedSnapshot(const string & snapshotFile, const string & logFile) {
+    // sections: arena, records, amounts, free, list, ids, smaller, greater
+    const struct { int mSection; size_t mIndex; uint32_t mValue; } corruptions[] = {
+        { 4, 0, 1000000 },      // list handle out of records
+        { 5, 1, 1000000 },      // ids handle out of records
+        { 4, 1, 0 },            // company twice in the list
+        { 1, 4, 1000000 },      // record offset out of the arena
+        { 1, 5, 1000000 },      // name length out of the arena
+        { 3, 0, 1000000 },      // free handle out of records
+        { 3, 0, 0 },            // free handle of a live record
+        { -1, 0, 0 },           // section sizes wrapping around
+    };
+    for (const auto & corruption : corruptions) {
+        remove(snapshotFile.c_str());
+        remove(logFile.c_str());
+        {
+            CPersistentVATRegister reg;
+            assert( reg.open(snapshotFile, logFile) );
+            for (int i = 0; i < 10; i++)
+                assert( reg.newCompany("Company " + to_string(i), "Street", to_string(i)) );
+            assert( reg.cancelCompany("5") && reg.invoice("1", 10) );
+            assert( reg.checkpoint() );
+        }
+        {
+            CPersistentVATRegister reg;
+            assert( reg.open(snapshotFile, logFile) );
+        }
+        if (corruption.mSection < 0) wrapSnapshotSizes(snapshotFile);
+        else corruptSnapshot(snapshotFile, corruption.mSection, corruption.mIndex, corruption.mValue);
+        CPersistentVATRegister reg;
+        assert(!reg.open(snapshotFile, logFile) );
+        string name, addr;
+        assert(!reg.firstCompany(name, addr) );
+    }
+    remove(snapshotFile.c_str());
+    remove(logFile.c_str());
+}
+
+void testPersistent() {
+    const string snapshotFile = "test_snapshot", logFile = "test_oplog";
+    remove(snapshotFile.c_str());
+    remove(logFile.c_str());
+
+    CVATRegister ref;
+    unsigned int seed = 13;
+    auto randomOps = [&](auto & reg, int count) {
+        for (int i = 0; i < count; i++) {
+            seed = seed * 1103515245 + 12345;
+            const unsigned int r = seed >> 8;
+            const string id = to_string(r % 300), name = "Company " + to_string(r % 300);
+            switch (r % 7) {
+                case 0: case 1:
+                    assert( reg.newCompany(name, "Street", id) == ref.newCompany(name, "Street", id) ); break;
+                case 2:
+                    assert( reg.cancelCompany(id) == ref.cancelCompany(id) ); break;
+                case 3:
+                    assert( reg.cancelCompany(name, "STREET") == ref.cancelCompany(name, "STREET") ); break;
+                case 4: case 5:
+                    assert( reg.invoice(id, r % 1000) == ref.invoice(id, r % 1000) ); break;
+                default:
+                    assert( reg.invoice(name, "street", r % 1000) == ref.invoice(name, "street", r % 1000) ); break;
+            }
+        }
+    };
+
+    {
+        CPersistentVATRegister reg;
+        assert( reg.open(snapshotFile, logFile) );
+        randomOps(reg, 3000);
+        assertSameRegisters(reg, ref);
+    }
+    {
+        // log only
+        CPersistentVATRegister reg;
+        assert( reg.open(snapshotFile, logFile) );
+        assertSameRegisters(reg, ref);
+        randomOps(reg, 2000);
+        assert( reg.checkpoint() );
+        randomOps(reg, 2000);
+    }
+    {
+        // snapshot and log
+        CPersistentVATRegister reg;
+        assert( reg.open(snapshotFile, logFile) );
+        assertSameRegisters(reg, ref);
+        assert( reg.checkpoint() );
+    }
+    {
+        // snapshot only, then a torn record at the end of the log
+        CPersistentVATRegister reg;
+        assert( reg.open(snapshotFile, logFile) );
+        assertSameRegisters(reg, ref);
+        randomOps(reg, 500);
+    }
+    FILE * f = fopen(logFile.c_str(), "ab");
+    fwrite("\x01\x00\x00", 1, 3, f);
+    fclose(f);
+    {
+        CPersistentVATRegister reg;
+        assert( reg.open(snapshotFile, logFile) );
+        assertSameRegisters(reg, ref);
+        randomOps(reg, 500);
+    }
+    {
+        CPersistentVATRegister reg;
+        assert( reg.open(snapshotFile, logFile) );
+        assertSameRegisters(reg, ref);
+    }
+
+    // a corrupted snapshot is refused
+    f = fopen(snapshotFile.c_str(), "ab");
+    fwrite("x", 1, 1, f);
+    fclose(f);
+    CPersistentVATRegister broken;
+    assert(!broken.open(snapshotFile, logFile) );
+    string name, addr;
+    assert(!broken.firstCompany(name, addr) );
+    // nothing changes without a log
+    assert(!broken.newCompany("Company", "Street", "1") );
+    assert(!broken.firstCompany(name, addr) );
+
+    testPersistentLogFailure(snapshotFile, logFile);
+    testCorruptedSnapshot(snapshotFile, logFile);
+
+    remove(snapshotFile.c_str());
+    remove(logFile.c_str());
+    cout << "PASSED: Persistent register" << endl;
+}
+
+void testConcurrent() {
+    const int threadCount = 8;
+    const int companyCount = 64;
+    const int invoiceCount = 5000;
+    CConcurrentVATRegister reg;
+    for (int i = 0; i < companyCount; i++)
+        assert( reg.newCompany ( "Company " + to_string(i), "Street", to_string(i) ) );
+
+    vector<thread> threads;
+    for (int t = 0; t < threadCount; t++)
+        threads.emplace_back([&reg, t]() {
+            for (int i = 0; i < invoiceCount; i++) {
+                const int company = (i + t) % companyCount;
+                if (i % 2) assert( reg.invoice ( to_string(company), 1 ) );
+                else assert( reg.invoice ( "COMPANY " + to_string(company), "street", 1 ) );
+            }
+        });
+    // companies come and go while the others are invoiced and iterated
+    threads.emplace_back([&reg]() {
+        for (int i = 0; i < invoiceCount; i++) {
+            const string id = "temp" + to_string(i % 10);
+            const string name = "Temp " + to_string(i % 10);
+            if (!reg.newCompany ( name, "Street", id )) assert( reg.cancelCompany ( id ) );
+        }
+    });
+    threads.emplace_back([&reg]() {
+        for (int i = 0; i < 200; i++) {
+            string name, addr, prevName;
+            int count = 0;
+            for (bool ok = reg.firstCompany ( name, addr ); ok; ok = reg.nextCompany ( name, addr )) {
+                Reg::CompareNameAddr cmp;
+                assert( count == 0 || cmp(prevName, name) );
+                prevName = name;
+                count++;
+            }
+            assert( count >= companyCount );
+        }
+    });
+    threads.emplace_back([&reg]() {
+        for (int i = 0; i < 200; i++) {
+            // the same snapshot is walked twice while companies change
+            const CConcurrentVATRegister::Snapshot snapshot = reg.snapshot();
+            vector<string> walks[2];
+            for (auto & walk : walks) {
+                string name, addr;
+                for (bool ok = snapshot.firstCompany ( name, addr ); ok; ok = snapshot.nextCompany ( name, addr ))
+                    walk.push_back(name);
+            }
+            assert( walks[0] == walks[1] && walks[0].size() >= companyCount );
+        }
+    });
+    for (auto & th : threads) th.join();
+
+    unsigned int total = 0, sumIncome;
+    for (int i = 0; i < companyCount; i++) {
+        assert( reg.audit ( to_string(i), sumIncome ) );
+        total += sumIncome;
+    }
+    assert( total == threadCount * invoiceCount );
+    assert( reg.medianInvoice () == 1 );
+    assert( reg.invoice ( "0", 10 ) );
+    assert( reg.invoice ( "1", 10 ) );
+    assert( reg.medianInvoice () == 1 );
+    assert( reg.audit ( "Company 0", "Street", sumIncome ) && sumIncome == total / companyCount + 10 );
+
+    // cancelled companies stay in the snapshots taken before
+    const CConcurrentVATRegister::Snapshot snapshot = reg.snapshot();
+    assert( reg.newCompany ( "AAA", "Street", "new" ) );
+    assert( reg.cancelCompany ( "0" ) );
+    string name, addr;
+    assert( snapshot.firstCompany ( name, addr ) && name == "Company 0" );
+    assert( reg.firstCompany ( name, addr ) && name == "AAA" );
+    // once no snapshot holds the list, it is changed in place
+    {
+        const CConcurrentVATRegister::Snapshot held = reg.snapshot();
+        assert( reg.cancelCompany ( "AAA", "Street" ) );
+        assert( held.firstCompany ( name, addr ) && name == "AAA" );
+    }
+    assert( reg.newCompany ( "AAB", "Street", "new2" ) && reg.cancelCompany ( "1" ) );
+    assert( reg.snapshot().firstCompany ( name, addr ) && name == "AAB" );
+    assert( snapshot.firstCompany ( name, addr ) && name == "Company 0" );
+    static_assert( !is_default_constructible<CConcurrentVATRegister::Snapshot>::value,
+                   "a snapshot comes from a register only" );
+
+    cout << "PASSED: Concurrent register" << endl;
+}
+
 void testProgtest() {
     string name, addr;
     unsigned int sumIncome;
@@ -551,11 +1863,212 @@ void testProgtest() {
     cout << "PASSED: ProgTest" << endl;
 }
 
+#ifdef BENCHMARK
+#include <chrono>
+#include <queue>
+#include <random>
+
+/** Heap bytes currently allocated through operator new */
+static atomic<size_t> gHeapBytes(0);
+
+void * operator new(size_t size) {
+    char * ptr = (char *) malloc(size + sizeof(max_align_t));
+    if (ptr == nullptr) throw bad_alloc();
+    *(size_t *) ptr = size;
+    gHeapBytes += size;
+    return ptr + sizeof(max_align_t);
+}
+void operator delete(void * ptr) noexcept {
+    if (ptr == nullptr) return;
+    char * base = (char *) ptr - sizeof(max_align_t);
+    gHeapBytes -= *(size_t *) base;
+    free(base);
+}
+void operator delete(void * ptr, size_t) noexcept { operator delete(ptr); }
+
+template <class F>
+double measureMs(F f) {
+    const auto start = chrono::steady_clock::now();
+    f();
+    const auto end = chrono::steady_clock::now();
+    return chrono::duration<double, milli>(end - start).count();
+}
+
+template <class Queue>
+unsigned long long runQueue(Queue & q, const vector<unsigned int> & data) {
+    unsigned long long sum = 0;
+    for (auto item : data) q.push(item);
+    for (auto item : data) {
+        sum += q.top();
+        q.pop();
+        q.push(item);
+    }
+    while (!q.empty()) {
+        sum += q.top();
+        q.pop();
+    }
+    return sum;
+}
+
+void benchmarkQueue() {
+    const size_t count = 2000000;
+    vector<unsigned int> data(count);
+    unsigned int seed = 42;
+    for (auto & item : data) item = seed = seed * 1103515245 + 12345;
+
+    unsigned long long sumStd = 0, sumBin = 0, sumQuad = 0, sumReplace = 0;
+    const double tStd = measureMs([&]() {
+        priority_queue<unsigned int> q;
+        sumStd = runQueue(q, data);
+    });
+    const double tBin = measureMs([&]() {
+        Reg::PriorityQueue<less<unsigned int>, unsigned int, 2> q;
+        sumBin = runQueue(q, data);
+    });
+    const double tQuad = measureMs([&]() {
+        Reg::PriorityQueue<less<unsigned int>, unsigned int, 4> q;
+        sumQuad = runQueue(q, data);
+    });
+    const double tReplace = measureMs([&]() {
+        Reg::PriorityQueue<less<unsigned int>> q;
+        q.reserve(count);
+        q.heapify(data.begin(), data.end());
+        for (auto item : data) sumReplace += q.replaceTop(item);
+        while (!q.empty()) sumReplace += q.pop();
+    });
+    assert(sumStd == sumBin && sumStd == sumQuad && sumStd == sumReplace);
+
+    cout << "BENCH: Priority queue, " << count << " items" << endl;
+    cout << "  std::priority_queue  " << tStd << " ms" << endl;
+    cout << "  2-ary heap           " << tBin << " ms" << endl;
+    cout << "  4-ary heap           " << tQuad << " ms" << endl;
+    cout << "  heapify + replaceTop " << tReplace << " ms" << endl;
+}
+
+/** Company layout used before CompanyPool, one heap object per company */
+struct LegacyCompany {
+    string mName;
+    string mAddr;
+    string mId;
+    unsigned int mAmount;
+};
+
+void benchmarkCompanyMemory() {
+    const size_t count = 1000000;
+    mt19937 rng(42);
+    vector<string> names(count), addrs(count), ids(count);
+    for (size_t i = 0; i < count; i++) {
+        names[i] = "Company " + to_string(rng());
+        addrs[i] = "Street " + to_string(rng() % 1000) + ", City " + to_string(rng() % 100);
+        ids[i] = "CZ" + to_string(i);
+    }
+    vector<size_t> order(count);
+    for (size_t i = 0; i < count; i++) order[i] = i;
+    shuffle(order.begin(), order.end(), rng);
+
+    Reg::CompareNameAddr cmp;
+    auto legacyLess = [&](const LegacyCompany * a, const LegacyCompany * b) {
+        return cmp.compare(a -> mName, a -> mAddr, b -> mName, b -> mAddr) < 0;
+    };
+
+    size_t before = gHeapBytes;
+    vector<LegacyCompany*> legacyList, legacyIds;
+    for (size_t i = 0; i < count; i++) {
+        LegacyCompany * c = new LegacyCompany { names[i], addrs[i], ids[i], 0 };
+        legacyList.push_back(c);
+        legacyIds.push_back(c);
+    }
+    sort(legacyList.begin(), legacyList.end(), legacyLess);
+    const double legacyBytes = double(gHeapBytes - before) / count;
+    unsigned long long legacySum = 0;
+    const double tLegacy = measureMs([&]() {
+        for (auto i : order) {
+            LegacyCompany key { names[i], addrs[i], "", 0 };
+            auto it = lower_bound(legacyList.begin(), legacyList.end(), &key, legacyLess);
+            legacySum += (*it) -> mAmount + (*it) -> mName.size();
+        }
+    });
+    for (auto ptr : legacyList) delete ptr;
+
+    before = gHeapBytes;
+    CVATRegister * reg = new CVATRegister();
+    for (size_t i = 0; i < count; i++)
+        reg -> newCompany(names[i], addrs[i], ids[i]);
+    const double poolHeapBytes = double(gHeapBytes - before) / count;
+    const double poolBytes = double(reg -> memoryUsage()) / count;
+    unsigned long long poolSum = 0;
+    const double tPool = measureMs([&]() {
+        unsigned int sumIncome;
+        for (auto i : order) {
+            reg -> audit(names[i], addrs[i], sumIncome);
+            poolSum += sumIncome + names[i].size();
+        }
+    });
+    delete reg;
+    assert(legacySum == poolSum);
+
+    cout << "BENCH: Company storage, " << count << " companies" << endl;
+    cout << "  Company*    " << legacyBytes << " B/company, lookups " << tLegacy << " ms" << endl;
+    cout << "  CompanyPool " << poolHeapBytes << " B/company (" << poolBytes
+        << " B used), lookups " << tPool << " ms" << endl;
+}
+
+void benchmarkCompareSort() {
+    const size_t count = 1000000;
+    mt19937 rng(7);
+    const string prefixes[] = { "Company ", "INTERNATIONAL TRADING COMPANY ", "Stavebni Podnik Praha " };
+    vector<pair<string, string>> companies(count);
+    for (auto & c : companies) {
+        c.first = prefixes[rng() % 3] + to_string(rng() % 100000);
+        c.second = "Street " + to_string(rng() % 1000) + ", City " + to_string(rng() % 100);
+        if (rng() % 2) transform(c.first.begin(), c.first.end(), c.first.begin(), ::toupper);
+    }
+    vector<pair<string, string>> reference = companies;
+
+    Reg::CompareNameAddr cmp;
+    const double tVector = measureMs([&]() {
+        sort(companies.begin(), companies.end(), [&](const auto & a, const auto & b) {
+            return cmp.compare(a.first, a.second, b.first, b.second) < 0;
+        });
+    });
+    const double tScalar = measureMs([&]() {
+        sort(reference.begin(), reference.end(), [&](const auto & a, const auto & b) {
+            const int nameCmp = referenceCompare(a.first, b.first);
+            if (nameCmp != 0) return nameCmp < 0;
+            return referenceCompare(a.second, b.second) < 0;
+        });
+    });
+    for (size_t i = 0; i < count; i++)
+        assert( referenceCompare(companies[i].first, reference[i].first) == 0
+                && referenceCompare(companies[i].second, reference[i].second) == 0 );
+
+    cout << "BENCH: Sorting " << count << " companies by name and address" << endl;
+    cout << "  char by char " << tScalar << " ms" << endl;
+#if defined(__AVX2__)
+    cout << "  AVX2         " << tVector << " ms" << endl;
+#elif defined(__SSE2__)
+    cout << "  SSE2         " << tVector << " ms" << endl;
+#else
+    cout << "  scalar       " << tVector << " ms" << endl;
+#endif
+}
+#endif /* BENCHMARK */
+
 int main ( void ) {
 
     testCompare();
     testQueue();
+    testMedian();
     testProgtest();
+    testPool();
+    testPersistent();
+    testConcurrent();
+
+#ifdef BENCHMARK
+    benchmarkQueue();
+    benchmarkCompanyMemory();
+    benchmarkCompareSort();
+#endif /* BENCHMARK */
 
     cout << "All tests have PASSED!" << endl;
 
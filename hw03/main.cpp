@@ -8,28 +8,247 @@
 #include <string>
 #include <sstream>
 #include <stdexcept>
+#include <optional>
+#include <vector>
+#include <algorithm>
 using namespace std;
 #endif /* __PROGTEST__ */
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 // a dummy exception class, keep this implementation
 class InvalidDateException : public invalid_argument {
     public:
         InvalidDateException ( )
             : invalid_argument ( "invalid date or format" ) {}
 };
+/**
+ * Date format compiled into a compact program stored in a string
+ * Each instruction is one opcode byte, literals are followed by their
+ * length and the text itself. The program is attached to a stream
+ * through xalloc/pword by the date_format manipulator.
+ */
+class CDateFormat {
+    public:
+        explicit CDateFormat(const char * fmt);
+
+        void format(ostream & out, const int year, const int month, const int day) const;
+        bool parse(istream & in, int & year, int & month, int & day) const;
+
+        static const CDateFormat & of(ios_base & ios);
+        static void install(ios_base & ios, const CDateFormat & format);
+        static CDateFormat & pending();
+        static char * formatNumber(char * end, int value, const int digits);
+    private:
+        enum Op : char { LITERAL, YEAR, MONTH, DAY };
+        static const int YEAR_DIGITS = 4;
+        static const int MONTH_DIGITS = 2;
+        static const int DAY_DIGITS = 2;
+
+        string mProgram;
+        bool mParsable;
+
+        void addLiteral(const char * text, size_t length);
+        static bool parseNumber(streambuf * buf, int & value, const int digits);
+        static int index();
+        static void callback(ios_base::event event, ios_base & ios, int index);
+};
+
+CDateFormat::CDateFormat(const char * fmt) {
+    int fields[DAY + 1] = {};
+    const char * literal = fmt;
+    while (*fmt) {
+        if (*fmt != '%') {
+            fmt++;
+            continue;
+        }
+        addLiteral(literal, fmt - literal);
+        Op op;
+        switch (fmt[1]) {
+            case 'Y': op = YEAR; break;
+            case 'm': op = MONTH; break;
+            case 'd': op = DAY; break;
+            case '\0':
+                literal = fmt;
+                fmt++;
+                continue;
+            default:
+                // %% and unknown conversions stand for the next char itself
+                literal = fmt + 1;
+                fmt += 2;
+                continue;
+        }
+        mProgram += op;
+        fields[op]++;
+        fmt += 2;
+        literal = fmt;
+    }
+    addLiteral(literal, fmt - literal);
+    mParsable = fields[YEAR] == 1 && fields[MONTH] == 1 && fields[DAY] == 1;
+}
+void CDateFormat::addLiteral(const char * text, size_t length) {
+    while (length > 0) {
+        const size_t chunk = min(length, (size_t) 255);
+        mProgram += LITERAL;
+        mProgram += (char) chunk;
+        mProgram.append(text, chunk);
+        text += chunk;
+        length -= chunk;
+    }
+}
+
+/** Writes the value zero padded to the given number of digits so that it ends at end */
+char * CDateFormat::formatNumber(char * end, int value, const int digits) {
+    const bool negative = value < 0;
+    unsigned int rest = negative ? 0u - value : value;
+    char * begin = end;
+    do {
+        *--begin = '0' + rest % 10;
+        rest /= 10;
+    } while (rest > 0);
+    while (end - begin < digits) *--begin = '0';
+    if (negative) *--begin = '-';
+    return begin;
+}
+void CDateFormat::format(ostream & out, const int year, const int month, const int day) const {
+    ostream::sentry sentry(out);
+    if (!sentry) return;
+    streambuf * buf = out.rdbuf();
+    char number[16];
+    char * const end = number + sizeof(number);
+    bool ok = true;
+    for (size_t i = 0; ok && i < mProgram.size(); ) {
+        const char * begin;
+        switch (mProgram[i++]) {
+            case LITERAL: {
+                const size_t length = (unsigned char) mProgram[i++];
+                ok = buf -> sputn(mProgram.data() + i, length) == (streamsize) length;
+                i += length;
+                continue;
+            }
+            case YEAR:  begin = formatNumber(end, year, YEAR_DIGITS); break;
+            case MONTH: begin = formatNumber(end, month, MONTH_DIGITS); break;
+            default:    begin = formatNumber(end, day, DAY_DIGITS); break;
+        }
+        ok = buf -> sputn(begin, end - begin) == end - begin;
+    }
+    out.width(0);
+    if (!ok) out.setstate(ios::badbit);
+}
+
+/** Reads exactly the given number of digits */
+bool CDateFormat::parseNumber(streambuf * buf, int & value, const int digits) {
+    value = 0;
+    for (int i = 0; i < digits; i++) {
+        const int c = buf -> sgetc();
+        if (c < '0' || '9' < c) return false;
+        value = value * 10 + (c - '0');
+        buf -> sbumpc();
+    }
+    return true;
+}
+/** Reads the date, sets failbit if the input does not match the format */
+bool CDateFormat::parse(istream & in, int & year, int & month, int & day) const {
+    istream::sentry sentry(in);
+    if (!sentry) return false;
+    streambuf * buf = in.rdbuf();
+    bool ok = mParsable;
+    for (size_t i = 0; ok && i < mProgram.size(); ) {
+        switch (mProgram[i++]) {
+            case LITERAL: {
+                const size_t length = (unsigned char) mProgram[i++];
+                for (size_t j = 0; ok && j < length; j++) {
+                    ok = buf -> sgetc() == (unsigned char) mProgram[i + j];
+                    if (ok) buf -> sbumpc();
+                }
+                i += length;
+                break;
+            }
+            case YEAR:  ok = parseNumber(buf, year, YEAR_DIGITS); break;
+            case MONTH: ok = parseNumber(buf, month, MONTH_DIGITS); break;
+            default:    ok = parseNumber(buf, day, DAY_DIGITS); break;
+        }
+    }
+    if (buf -> sgetc() == char_traits<char>::eof()) in.setstate(ios::eofbit);
+    if (!ok) in.setstate(ios::failbit);
+    return ok;
+}
+
+int CDateFormat::index() {
+    static const int i = ios_base::xalloc();
+    return i;
+}
+/** Frees or clones the stream's format together with the stream */
+void CDateFormat::callback(ios_base::event event, ios_base & ios, int index) {
+    void *& ptr = ios.pword(index);
+    if (event == ios_base::erase_event) {
+        delete (CDateFormat *) ptr;
+        ptr = nullptr;
+    } else if (event == ios_base::copyfmt_event && ptr != nullptr) {
+        ptr = new CDateFormat(*(const CDateFormat *) ptr);
+    }
+}
+/** Format set on the stream or the ISO one */
+const CDateFormat & CDateFormat::of(ios_base & ios) {
+    static const CDateFormat iso("%Y-%m-%d");
+    const void * ptr = ios.pword(index());
+    return ptr == nullptr ? iso : *(const CDateFormat *) ptr;
+}
+void CDateFormat::install(ios_base & ios, const CDateFormat & format) {
+    void *& ptr = ios.pword(index());
+    delete (CDateFormat *) ptr;
+    ptr = new CDateFormat(format);
+    long & registered = ios.iword(index());
+    if (!registered) {
+        ios.register_callback(callback, index());
+        registered = 1;
+    }
+}
+/**
+ * The manipulator has to be a plain function pointer, so the compiled
+ * format waits here until the manipulator is applied to a stream
+ */
+CDateFormat & CDateFormat::pending() {
+    static thread_local CDateFormat format("");
+    return format;
+}
+
 // date_format manipulator
 ios_base & ( * date_format ( const char * fmt ) ) ( ios_base & x ) {
-    return [] ( ios_base & ios ) -> ios_base & { return ios; };
+    CDateFormat::pending() = CDateFormat(fmt);
+    return [] ( ios_base & ios ) -> ios_base & {
+        CDateFormat::install(ios, CDateFormat::pending());
+        return ios;
+    };
 }
 
 
+/** Reasons a CDate operation can fail without throwing */
+enum class DateError {
+    OK,
+    OUT_OF_RANGE,
+};
+
+class CDateResult;
+
+/**
+ * The date is stored as the number of days since 1970-01-01,
+ * so arithmetic and comparison are single integer operations
+ * and year, month and day are only computed when needed
+ */
 class CDate {
     private:
-        int mYear;
-        int mMonth;
-        int mDay;
+        int mDays;
     public:
+        static const int MIN_YEAR = -1000000;
+        static const int MAX_YEAR =  1000000;
+
         CDate(const int year, const int month, const int day);
+        static optional<CDate> tryMake(const int year, const int month, const int day);
+        CDateResult tryAdd(const int days) const;
+        int weekday() const;
         int operator-(const CDate & date) const;
         CDate operator +(const int days) const;
         CDate operator -(const int days) const;
@@ -45,106 +264,148 @@ class CDate {
         bool operator !=(const CDate & date) const;
         friend ostream & operator << (ostream & out, const CDate & date);
         friend istream & operator >> (istream & in, CDate & date);
+        friend size_t parseDates(const char * buf, size_t len, CDate * out,
+                size_t * badRows, size_t & badCount);
+        friend size_t formatDates(const CDate * dates, size_t n, char * out);
+        friend class CBusinessCalendar;
     private:
         static const int epochStart = 1970;
+        CDate() = default;
         int toDays() const;
         static CDate fromDays(int days);
-        void updateWithDays(int days);
+        void toCivil(int & year, int & month, int & day) const;
+
+        static constexpr int daysFromCivil(int year, const int month, const int day);
+        static constexpr void civilFromDays(int days, int & year, int & month, int & day);
 
         static bool checkValid(const int year, const int month, const int day);
         static bool isLeap(const int year);
         static int leapInInterval(int start, int end);
-        static int daysInYearsInterval(int start, int end);
-        static int daysInYear(const int year, const int month);
         static int daysInMonth(const int month, const bool isLeap);
 
         friend void testIsLeap();
         friend void testLeapInInterval();
         friend void testDayConversion();
         friend void testToDate(const CDate & date);
+        friend void testBatch();
+};
+
+/** Either a date or the reason why there is none, like std::expected */
+class CDateResult {
+    private:
+        optional<CDate> mDate;
+        DateError mError;
+    public:
+        CDateResult(const CDate & date) : mDate(date), mError(DateError::OK) {}
+        CDateResult(const DateError error) : mError(error) {}
+        explicit operator bool() const { return mError == DateError::OK; }
+        DateError error() const { return mError; }
+        /** The date, throws bad_optional_access for an error result */
+        const CDate & value() const { return mDate.value(); }
 };
 
-CDate::CDate(int year, int month, int day)
-    : mYear(year), mMonth(month), mDay(day) {
+CDate::CDate(int year, int month, int day) {
         // cout << "Constructing " << *this << endl;
         if (!checkValid(year, month, day))
             throw invalid_argument("InvalidDateException");
+        mDays = daysFromCivil(year, month, day);
     }
 
 bool CDate::checkValid(const int year, const int month, const int day) {
+    if (year < MIN_YEAR || MAX_YEAR < year) return false;
     if (month < 1 || 12 < month) return false;
     if (day < 1 || CDate::daysInMonth(month, isLeap(year)) < day) return false;
     return true;
 }
 
+/** 0 for Monday up to 6 for Sunday, 1970-01-01 was a Thursday */
+int CDate::weekday() const {
+    const int weekday = (mDays + 3) % 7;
+    return weekday < 0 ? weekday + 7 : weekday;
+}
+
 int   CDate::operator-(const CDate & date) const {
-    return abs(toDays() - date.toDays());
+    return abs(mDays - date.mDays);
 }
 CDate CDate::operator +(const int days) const {
-    return fromDays(toDays() + days);
+    return fromDays(mDays + days);
 }
 inline CDate CDate::operator -(const int days) const {
     return *this + -days;
 }
 CDate CDate::operator++(int) {
     CDate backup = *this;
-    updateWithDays(toDays() + 1);
+    mDays++;
     return backup;
 }
 CDate CDate::operator--(int) {
     CDate backup = *this;
-    updateWithDays(toDays() - 1);
+    mDays--;
     return backup;
 }
 CDate & CDate::operator++() {
-    updateWithDays(toDays() + 1);
+    mDays++;
     return *this;
 }
 CDate & CDate::operator--() {
-    updateWithDays(toDays() - 1);
+    mDays--;
     return *this;
 }
-void CDate::updateWithDays(const int days) {
-    CDate updated = fromDays(days);
-    mYear  = updated.mYear;
-    mMonth = updated.mMonth;
-    mDay   = updated.mDay;
+
+/**
+ * Days since 1970-01-01 in O(1), based on
+ * http://howardhinnant.github.io/date_algorithms.html
+ * Years are shifted to start in March, so the leap day is the last one
+ * of a year, and split into 400 year eras which all have the same length
+ */
+constexpr int CDate::daysFromCivil(int year, const int month, const int day) {
+    year -= month <= 2;
+    const int era = (year >= 0 ? year : year - 399) / 400;
+    const unsigned int yearOfEra = year - era * 400;                               // [0, 399]
+    const unsigned int dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1; // [0, 365]
+    const unsigned int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear; // [0, 146096]
+    return era * 146097 + (int) dayOfEra - 719468;
+}
+/** Inverse of daysFromCivil */
+constexpr void CDate::civilFromDays(int days, int & year, int & month, int & day) {
+    days += 719468;
+    const int era = (days >= 0 ? days : days - 146096) / 146097;
+    const unsigned int dayOfEra = days - era * 146097;                             // [0, 146096]
+    const unsigned int yearOfEra =
+        (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365; // [0, 399]
+    const unsigned int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100); // [0, 365]
+    const unsigned int shiftedMonth = (5 * dayOfYear + 2) / 153;                   // [0, 11], March is 0
+    day = dayOfYear - (153 * shiftedMonth + 2) / 5 + 1;
+    month = shiftedMonth < 10 ? shiftedMonth + 3 : shiftedMonth - 9;
+    year = (int) yearOfEra + era * 400 + (month <= 2);
 }
 
 int CDate::toDays() const {
-    int days = CDate::daysInYearsInterval(epochStart, mYear);
-    days += CDate::daysInYear(mYear, mMonth);
-    days += mDay - 1;
-    return days;
+    return mDays;
 }
 CDate CDate::fromDays(int days) {
-    days++;
-    int year, month, day;
-    year = epochStart + days / 365;
-    while(true) {
-        int lower = daysInYearsInterval(epochStart, year);
-        int higher = daysInYearsInterval(epochStart, year + 1);
-        // cout << "Y " << year << " L: " << lower << " H: " << higher << endl;
-        if (higher < days) {
-            year++;
-            continue;
-        }
-        if (lower >= days) {
-            year--;
-            continue;
-        }
-        break;
-    }
-    int tempDays = daysInYearsInterval(epochStart, year);
-    month = 1;
-    for (; month < 12; month++) {
-        // cout << "D: " << daysInYear(year, month) << " T " << days << " TMP " << tempDays << endl;
-        if (tempDays + daysInYear(year, month + 1) >= days) {
-            break;
-        }
-    }
-    day = days - tempDays - daysInYear(year, month);
-    return CDate(year, month, day);
+    CDate date;
+    date.mDays = days;
+    return date;
+}
+void CDate::toCivil(int & year, int & month, int & day) const {
+    civilFromDays(mDays, year, month, day);
+}
+
+/** Same checks as the constructor, but reports invalid dates without throwing */
+optional<CDate> CDate::tryMake(const int year, const int month, const int day) {
+    if (!checkValid(year, month, day)) return nullopt;
+    CDate date;
+    date.mDays = daysFromCivil(year, month, day);
+    return date;
+}
+/** Moves the date by days, fails if the result leaves the supported years */
+CDateResult CDate::tryAdd(const int days) const {
+    static constexpr int minDays = daysFromCivil(MIN_YEAR, 1, 1);
+    static constexpr int maxDays = daysFromCivil(MAX_YEAR, 12, 31);
+    const long long result = (long long) mDays + days;
+    if (result < minDays || maxDays < result) return DateError::OUT_OF_RANGE;
+    return fromDays(result);
 }
 
 bool CDate::isLeap(const int year) {
@@ -156,10 +417,6 @@ int CDate::leapInInterval(int start, int end) {
 		- (end / 100 - start / 100)
 		+ (end / 4 - start / 4);
 }
-int CDate::daysInYearsInterval(int start, int end) {
-    int leap = leapInInterval(start, end);
-    return (end - start) * 365 + leap;
-}
 int CDate::daysInMonth(const int month, const bool isLeap) {
     switch (month) {
         case  1: return 31;
@@ -174,92 +431,242 @@ int CDate::daysInMonth(const int month, const bool isLeap) {
         case 10: return 31;
         case 11: return 30;
         case 12: return 31;
-        default: throw "Unknown month";
+        default: return 0;
     }
 }
-int CDate::daysInYear(const int year, const int month) {
-    int days = 0;
-	switch (month - 1) {
-		case 11: days += 30;
-		case 10: days += 31;
-		case 9: days += 30;
-		case 8: days += 31;
-		case 7: days += 31;
-		case 6: days += 30;
-		case 5: days += 31;
-		case 4: days += 30;
-		case 3: days += 31;
-		case 2: days += isLeap(year) ? 29 : 28;
-		case 1: days += 31;
-	}
-    return days;
-}
-
-bool CDate::operator < (const CDate & date) const {
-    if (mYear  < date.mYear ) return true;
-    if (mYear  > date.mYear ) return false;
-    if (mMonth < date.mMonth) return true;
-    if (mMonth > date.mMonth) return false;
-    if (mDay   < date.mDay  ) return true;
-    if (mDay   > date.mDay  ) return false;
-    return false;
+inline bool CDate::operator < (const CDate & date) const {
+    return mDays < date.mDays;
 }
 inline bool CDate::operator > (const CDate & date) const {
-    return !(*this <= date);
-}
-bool CDate::operator <=(const CDate & date) const {
-    if (mYear  < date.mYear ) return true;
-    if (mYear  > date.mYear ) return false;
-    if (mMonth < date.mMonth) return true;
-    if (mMonth > date.mMonth) return false;
-    if (mDay   < date.mDay  ) return true;
-    if (mDay   > date.mDay  ) return false;
-    return true;
+    return mDays > date.mDays;
+}
+inline bool CDate::operator <=(const CDate & date) const {
+    return mDays <= date.mDays;
 }
 inline bool CDate::operator >=(const CDate & date) const {
-    return !(*this < date);
+    return mDays >= date.mDays;
 }
-bool CDate::operator ==(const CDate & date) const {
-    if (mYear  != date.mYear ) return false;
-    if (mMonth != date.mMonth) return false;
-    if (mDay   != date.mDay  ) return false;
-    return true;
+inline bool CDate::operator ==(const CDate & date) const {
+    return mDays == date.mDays;
 }
 inline bool CDate::operator !=(const CDate & date) const {
-    return !(*this == date);
+    return mDays != date.mDays;
 }
 ostream & operator << (ostream & out, const CDate & date) {
-    return out
-        << setw(4) << setfill('0') << date.mYear << '-'
-        << setw(2) << setfill('0') << date.mMonth << '-'
-        << setw(2) << setfill('0') << date.mDay;
+    int year, month, day;
+    date.toCivil(year, month, day);
+    CDateFormat::of(out).format(out, year, month, day);
+    return out;
 }
 istream & operator >> (istream & in, CDate & date) {
     int year, month, day;
-    char dash;
-    in >> year;
-    in >> dash;
-    if (dash != '-') {
-        in.setstate(std::ios::failbit);
-        return in;
-    }
-    in >> month;
-    in >> dash;
-    if (dash != '-') {
-        in.setstate(std::ios::failbit);
-        return in;
-    }
-    in >> day;
+    if (!CDateFormat::of(in).parse(in, year, month, day)) return in;
     if (!CDate::checkValid(year, month, day)) {
         in.setstate(std::ios::failbit);
         return in;
     }
-    date.mYear  = year;
-    date.mMonth = month;
-    date.mDay   = day;
+    date.mDays = CDate::daysFromCivil(year, month, day);
     return in;
 }
 
+/** Reads "YYYY-MM-DD" from exactly 10 chars, returns false if the layout does not match */
+static inline bool parseIsoRow(const char * row, int & year, int & month, int & day) {
+#if defined(__SSSE3__)
+    // the row is followed by at least 6 more bytes of the buffer
+    const __m128i chars = _mm_loadu_si128((const __m128i *) row);
+    const __m128i digits = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+    const unsigned int isDigit = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_min_epu8(digits, _mm_set1_epi8(9)), digits));
+    const unsigned int isDash = _mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_set1_epi8('-')));
+    const unsigned int DIGITS = 0x36F; // YYYY-MM-DD
+    const unsigned int DASHES = 0x090;
+    if ((isDigit & DIGITS) != DIGITS || (isDash & DASHES) != DASHES) return false;
+    // YYYYMMDD -> 16 bit YY, YY, MM, DD
+    const __m128i packed = _mm_shuffle_epi8(digits,
+            _mm_setr_epi8(0, 1, 2, 3, 5, 6, 8, 9, -1, -1, -1, -1, -1, -1, -1, -1));
+    const __m128i pairs = _mm_maddubs_epi16(packed,
+            _mm_setr_epi8(10, 1, 10, 1, 10, 1, 10, 1, 0, 0, 0, 0, 0, 0, 0, 0));
+    year = _mm_cvtsi128_si32(_mm_madd_epi16(pairs, _mm_setr_epi16(100, 1, 0, 0, 0, 0, 0, 0)));
+    month = _mm_extract_epi16(pairs, 2);
+    day = _mm_extract_epi16(pairs, 3);
+    return true;
+#else
+    for (int i = 0; i < 10; i++) {
+        const bool dash = i == 4 || i == 7;
+        if (dash ? row[i] != '-' : (row[i] < '0' || '9' < row[i])) return false;
+    }
+    year = (row[0] - '0') * 1000 + (row[1] - '0') * 100 + (row[2] - '0') * 10 + (row[3] - '0');
+    month = (row[5] - '0') * 10 + (row[6] - '0');
+    day = (row[8] - '0') * 10 + (row[9] - '0');
+    return true;
+#endif
+}
+
+/**
+ * Parses newline separated ISO dates (YYYY-MM-DD, \r\n is accepted too)
+ * Valid rows are stored to out at their row index, items of bad rows
+ * are kept untouched and the row indexes are appended to badRows (if given),
+ * which has to have room for as many items as out
+ * Returns the number of rows, an empty last line is not counted
+ */
+size_t parseDates(const char * buf, size_t len, CDate * out, size_t * badRows, size_t & badCount) {
+    size_t rows = 0;
+    badCount = 0;
+    const char * const end = buf + len;
+    while (buf < end) {
+        const char * newLine = char_traits<char>::find(buf, end - buf, '\n');
+        const char * rowEnd = newLine == nullptr ? end : newLine;
+        const char * next = newLine == nullptr ? end : newLine + 1;
+        if (rowEnd > buf && rowEnd[-1] == '\r') rowEnd--;
+
+        int year, month, day;
+        bool ok = rowEnd - buf == 10;
+        if (ok) {
+#if defined(__SSSE3__)
+            if (end - buf >= 16) ok = parseIsoRow(buf, year, month, day);
+            else {
+                char row[16] = {};
+                char_traits<char>::copy(row, buf, 10);
+                ok = parseIsoRow(row, year, month, day);
+            }
+#else
+            ok = parseIsoRow(buf, year, month, day);
+#endif
+        }
+        if (ok && CDate::checkValid(year, month, day))
+            out[rows].mDays = CDate::daysFromCivil(year, month, day);
+        else if (badRows != nullptr) badRows[badCount++] = rows;
+        else badCount++;
+        rows++;
+        buf = next;
+    }
+    return rows;
+}
+
+/**
+ * Writes the dates as ISO rows ended by '\n', returns the number of bytes written
+ * Each date takes 11 bytes, years outside 0-9999 take up to 16 bytes
+ */
+size_t formatDates(const CDate * dates, size_t n, char * out) {
+    static const char pairs[] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char * const begin = out;
+    for (size_t i = 0; i < n; i++) {
+        int year, month, day;
+        dates[i].toCivil(year, month, day);
+        if (0 <= year && year <= 9999) {
+            char_traits<char>::copy(out, pairs + 2 * (year / 100), 2);
+            char_traits<char>::copy(out + 2, pairs + 2 * (year % 100), 2);
+            out += 4;
+        } else {
+            char number[16];
+            const char * first = CDateFormat::formatNumber(number + sizeof(number), year, 4);
+            const size_t length = number + sizeof(number) - first;
+            char_traits<char>::copy(out, first, length);
+            out += length;
+        }
+        out[0] = '-';
+        char_traits<char>::copy(out + 1, pairs + 2 * month, 2);
+        out[3] = '-';
+        char_traits<char>::copy(out + 4, pairs + 2 * day, 2);
+        out[6] = '\n';
+        out += 7;
+    }
+    return out - begin;
+}
+
+/**
+ * Working day arithmetic over CDate day numbers
+ * Saturdays, Sundays and the added holidays are days off. Weekdays are
+ * numbered consecutively (rank), so whole weeks are skipped by division
+ * and holidays are kept as a sorted vector of weekday ranks. Queries
+ * then cost O(log holidays) no matter how far apart the dates are.
+ */
+class CBusinessCalendar {
+    public:
+        bool addHoliday(const CDate & date);
+        bool isWorkingDay(const CDate & date) const;
+        int countWorkingDays(const CDate & from, const CDate & to) const;
+        CDate addWorkingDays(const CDate & date, const int days) const;
+    private:
+        vector<int> mHolidays;
+
+        static int floorDiv(const int a, const int b);
+        static int weekdayRank(const int days);
+        static int dayOfRank(const int rank);
+        int workingBefore(const int days) const;
+        int dayOfWorkingRank(const int workingRank) const;
+};
+
+inline int CBusinessCalendar::floorDiv(const int a, const int b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+/** Number of weekdays before the day, counted from Monday 1969-12-29 */
+inline int CBusinessCalendar::weekdayRank(const int days) {
+    const int shifted = days + 3;
+    const int weeks = floorDiv(shifted, 7);
+    return weeks * 5 + min(shifted - weeks * 7, 5);
+}
+/** Inverse of weekdayRank for weekdays */
+inline int CBusinessCalendar::dayOfRank(const int rank) {
+    const int weeks = floorDiv(rank, 5);
+    return weeks * 7 + (rank - weeks * 5) - 3;
+}
+
+/** Returns false for weekends and days already added */
+bool CBusinessCalendar::addHoliday(const CDate & date) {
+    if (date.weekday() >= 5) return false;
+    const int rank = weekdayRank(date.mDays);
+    auto it = lower_bound(mHolidays.begin(), mHolidays.end(), rank);
+    if (it != mHolidays.end() && *it == rank) return false;
+    mHolidays.insert(it, rank);
+    return true;
+}
+bool CBusinessCalendar::isWorkingDay(const CDate & date) const {
+    return date.weekday() < 5
+        && !binary_search(mHolidays.begin(), mHolidays.end(), weekdayRank(date.mDays));
+}
+
+/** Number of working days before the day, relative to some fixed day */
+inline int CBusinessCalendar::workingBefore(const int days) const {
+    const int rank = weekdayRank(days);
+    return rank - (lower_bound(mHolidays.begin(), mHolidays.end(), rank) - mHolidays.begin());
+}
+/**
+ * The day with the given working rank
+ * Holiday i would have the working rank mHolidays[i] - i, the result
+ * is shifted by the number of holidays whose working rank is not above it
+ */
+int CBusinessCalendar::dayOfWorkingRank(const int workingRank) const {
+    size_t lo = 0, hi = mHolidays.size();
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        if (mHolidays[mid] - (int) mid <= workingRank) lo = mid + 1;
+        else hi = mid;
+    }
+    return dayOfRank(workingRank + (int) lo);
+}
+
+/** Working days in [from, to), negative if to is before from */
+int CBusinessCalendar::countWorkingDays(const CDate & from, const CDate & to) const {
+    return workingBefore(to.mDays) - workingBefore(from.mDays);
+}
+/**
+ * The days-th working day after the date (before it for negative days),
+ * the date itself for 0
+ */
+CDate CBusinessCalendar::addWorkingDays(const CDate & date, const int days) const {
+    if (days == 0) return date;
+    const int target = days > 0
+        ? workingBefore(date.mDays + 1) + days - 1
+        : workingBefore(date.mDays) + days;
+    return CDate::fromDays(dayOfWorkingRank(target));
+}
+
 #ifndef __PROGTEST__
 void testIsLeap() {
 	assert(CDate::isLeap(2001) == false);
@@ -299,6 +706,186 @@ void testDayConversion() {
     testToDate(CDate(2020, 12, 31));
     testToDate(CDate(2020,  1,  1));
     testToDate(CDate(2020,  3,  1));
+
+    static_assert(CDate::daysFromCivil(1970, 1, 1) == 0, "Epoch has to be day 0");
+    static_assert(CDate::daysFromCivil(2022, 3, 21) == 19072, "Days from civil are broken");
+    static_assert(CDate::daysFromCivil(1969, 12, 31) == -1, "Days from civil are broken");
+    static_assert(sizeof(CDate) == 4, "CDate should hold just the day number");
+
+    // walk day by day through several eras
+    int year = 1, month = 1, day = 1;
+    for (int days = CDate(1, 1, 1).toDays(); year < 2500; days++) {
+        assert(CDate(year, month, day).toDays() == days);
+        assert(CDate::fromDays(days) == CDate(year, month, day));
+        int y, m, d;
+        CDate::fromDays(days).toCivil(y, m, d);
+        assert(y == year && m == month && d == day);
+        if (++day > CDate::daysInMonth(month, CDate::isLeap(year))) {
+            day = 1;
+            if (++month > 12) {
+                month = 1;
+                year++;
+            }
+        }
+    }
+}
+
+void testDateFormat() {
+    ostringstream oss;
+    istringstream iss;
+    const CDate a(2021, 3, 4);
+
+    // the format stays on the stream and is copied by copyfmt
+    oss << date_format("%d/%m/%Y") << a << ' ' << a + 1;
+    assert(oss.str() == "04/03/2021 05/03/2021");
+    ostringstream copy;
+    copy.copyfmt(oss);
+    oss.str("");
+    oss << date_format("[%Y]") << a;
+    assert(oss.str() == "[2021]");
+    copy << a;
+    assert(copy.str() == "04/03/2021");
+
+    // literals longer than a single instruction, a trailing %
+    const string longText(600, 'x');
+    oss.str("");
+    oss << date_format((longText + "%Y" + longText + "%").c_str()) << a;
+    assert(oss.str() == longText + "2021" + longText + "%");
+
+    // formats without all the fields cannot be read
+    CDate b(2000, 1, 1);
+    iss.str("2021");
+    assert(!(iss >> date_format("%Y") >> b));
+    assert(b == CDate(2000, 1, 1));
+
+    // leading white space is skipped, the rest of the input is kept
+    istringstream isoIss("  2021-03-04 rest");
+    string rest;
+    assert(isoIss >> b >> rest);
+    assert(b == a && rest == "rest");
+    isoIss.clear();
+    isoIss.str("2021-03-04");
+    assert(isoIss >> b);
+    assert(isoIss.eof());
+}
+
+void testBatch() {
+    const string input =
+        "2021-03-04\n"
+        "2001-02-29\n"   // not a leap year
+        "2001-1-01\n"
+        "\n"
+        "2000-02-29\r\n"
+        "hello kitty\n"
+        "2000-13-01\n"
+        "1999-12-31\n"
+        "2030-12-31";   // shorter than a vector at the end
+    const CDate dflt(1, 1, 1);
+    CDate out[10] = { dflt, dflt, dflt, dflt, dflt, dflt, dflt, dflt, dflt, dflt };
+    size_t bad[10], badCount;
+    assert(parseDates(input.data(), input.size(), out, bad, badCount) == 9);
+    assert(badCount == 5);
+    assert(bad[0] == 1 && bad[1] == 2 && bad[2] == 3 && bad[3] == 5 && bad[4] == 6);
+    assert(out[0] == CDate(2021, 3, 4));
+    assert(out[1] == dflt && out[2] == dflt && out[3] == dflt);
+    assert(out[4] == CDate(2000, 2, 29));
+    assert(out[7] == CDate(1999, 12, 31));
+    assert(out[8] == CDate(2030, 12, 31));
+    assert(parseDates((input + "\n").data(), input.size() + 1, out, nullptr, badCount) == 9);
+    assert(badCount == 5);
+
+    // round trip
+    const int count = 20000;
+    CDate * dates = new CDate[count];
+    for (int i = 0; i < count; i++) dates[i] = CDate::fromDays(i * 37 - 300000);
+    char * text = new char[count * 16];
+    const size_t length = formatDates(dates, count, text);
+    CDate * parsed = new CDate[count];
+    ostringstream oss;
+    for (int i = 0; i < count; i++) oss << dates[i] << '\n';
+    assert(oss.str() == string(text, length));
+    assert(parseDates(text, length, parsed, nullptr, badCount) == (size_t) count && badCount == 0);
+    for (int i = 0; i < count; i++) assert(parsed[i] == dates[i]);
+    delete [] dates;
+    delete [] text;
+    delete [] parsed;
+}
+
+void testTryMake() {
+    assert(CDate::tryMake(2000, 2, 29) == CDate(2000, 2, 29));
+    assert(!CDate::tryMake(2001, 2, 29));
+    assert(!CDate::tryMake(2000, 13, 1));
+    assert(!CDate::tryMake(2000, 0, 1));
+    assert(!CDate::tryMake(2000, 1, 0));
+    assert(!CDate::tryMake(CDate::MAX_YEAR + 1, 1, 1));
+    assert(CDate::tryMake(CDate::MIN_YEAR, 1, 1));
+
+    const CDate a(2000, 1, 1);
+    CDateResult r = a.tryAdd(366);
+    assert(r && r.error() == DateError::OK && r.value() == CDate(2001, 1, 1));
+    r = a.tryAdd(-1);
+    assert(r && r.value() == CDate(1999, 12, 31));
+    r = a.tryAdd(2147483647);
+    assert(!r && r.error() == DateError::OUT_OF_RANGE);
+    r = CDate(CDate::MAX_YEAR, 12, 31).tryAdd(1);
+    assert(!r && r.error() == DateError::OUT_OF_RANGE);
+    r = CDate(CDate::MIN_YEAR, 1, 1).tryAdd(-2147483647 - 1);
+    assert(!r && r.error() == DateError::OUT_OF_RANGE);
+    assert(CDate(CDate::MIN_YEAR, 1, 1).tryAdd(0));
+    // an error result has no value to read
+    bool thrown = false;
+    try {
+        r.value();
+    } catch (const bad_optional_access &) {
+        thrown = true;
+    }
+    assert(thrown);
+}
+
+void testBusinessCalendar() {
+    assert(CDate(1970, 1, 1).weekday() == 3);
+    assert(CDate(2022, 3, 21).weekday() == 0);
+    assert(CDate(1969, 12, 28).weekday() == 6);
+    assert(CDate(1000, 1, 1).weekday() == 2);
+
+    CBusinessCalendar cal;
+    assert( cal.addHoliday(CDate(2022, 12, 26)));
+    assert(!cal.addHoliday(CDate(2022, 12, 26)));
+    assert(!cal.addHoliday(CDate(2022, 12, 25)));  // Sunday
+    assert( cal.addHoliday(CDate(2023, 1, 2)));
+    assert(!cal.isWorkingDay(CDate(2022, 12, 26)));
+    assert(!cal.isWorkingDay(CDate(2022, 12, 24)));
+    assert( cal.isWorkingDay(CDate(2022, 12, 27)));
+    assert(cal.addWorkingDays(CDate(2022, 12, 23), 1) == CDate(2022, 12, 27));
+    assert(cal.addWorkingDays(CDate(2022, 12, 27), -1) == CDate(2022, 12, 23));
+    assert(cal.addWorkingDays(CDate(2022, 12, 30), 1) == CDate(2023, 1, 3));
+    assert(cal.countWorkingDays(CDate(2022, 12, 19), CDate(2023, 1, 9)) == 13);
+    assert(cal.countWorkingDays(CDate(2023, 1, 9), CDate(2022, 12, 19)) == -13);
+
+    // compare with walking day by day
+    unsigned int seed = 3;
+    for (int i = 0; i < 400; i++) {
+        seed = seed * 1103515245 + 12345;
+        cal.addHoliday(CDate(1969, 1, 1) + (int) ((seed >> 8) % 1000));
+    }
+    const CDate start(1968, 6, 1);
+    for (int offset = 0; offset < 1500; offset += 5) {
+        const CDate from = start + offset;
+        const int fromWorking = cal.isWorkingDay(from);
+        CDate day = from;
+        int working = 0;
+        for (int i = 1; i < 400; i++) {
+            if (cal.isWorkingDay(day)) working++;
+            ++day;
+            assert(cal.countWorkingDays(from, day) == working);
+            assert(cal.countWorkingDays(day, from) == -working);
+            if (cal.isWorkingDay(day)) {
+                assert(cal.addWorkingDays(from, working - fromWorking + 1) == day);
+                if (fromWorking && working > 0)
+                    assert(cal.addWorkingDays(day, -working) == from);
+            }
+        }
+    }
 }
 
 void testProgrest() {
@@ -529,12 +1116,191 @@ void testProgtestBonusTest() {
     assert ( oss.str () == "2000-01-01" );
 }
 
+#ifdef BENCHMARK
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <random>
+
+template <class F>
+double measureMs(F f) {
+    const auto start = chrono::steady_clock::now();
+    f();
+    const auto end = chrono::steady_clock::now();
+    return chrono::duration<double, milli>(end - start).count();
+}
+
+void benchmarkDays() {
+    const int count = 1000000;
+    const CDate start(4000, 1, 1);
+    // every step is stored, so the loops cannot be folded into one addition
+    volatile int sink = 0;
+    const double tPlus = measureMs([&]() {
+        for (int i = -count; i <= count; i++) sink = (start + i) - start;
+    });
+    assert( sink == count );
+    CDate d = start - count;
+    const double tInc = measureMs([&]() {
+        for (int i = 0; i < 2 * count; i++) sink = (++d) - start;
+    });
+    assert( d == start + count && sink == count );
+    const double tDec = measureMs([&]() {
+        for (int i = 0; i < 2 * count; i++) sink = (--d) - start;
+    });
+    assert( d == start - count );
+
+    cout << "BENCH: Day arithmetic over +-" << count << " days" << endl;
+    cout << "  operator+  " << tPlus << " ms" << endl;
+    cout << "  operator++ " << tInc << " ms" << endl;
+    cout << "  operator-- " << tDec << " ms" << endl;
+}
+
+void benchmarkFormat() {
+    const int count = 1000000;
+    const CDate first(1900, 1, 1);
+    ostringstream oss;
+    const double tFormat = measureMs([&]() {
+        for (int i = 0; i < count; i++) oss << first + i % 100000 << '\n';
+    });
+    istringstream iss(oss.str());
+    CDate d = first;
+    long long sum = 0;
+    const double tParse = measureMs([&]() {
+        for (int i = 0; i < count; i++) {
+            iss >> d;
+            sum += d - first;
+        }
+    });
+    assert( iss && sum > 0 );
+
+    cout << "BENCH: " << count << " dates through iostreams" << endl;
+    cout << "  operator<< " << tFormat << " ms" << endl;
+    cout << "  operator>> " << tParse << " ms" << endl;
+}
+
+void benchmarkBatch() {
+    const int count = 10000000;
+    const CDate first(1900, 1, 1);
+    vector<CDate> dates, parsed;
+    for (int i = 0; i < count; i++) dates.push_back(first + i % 100000);
+    parsed = dates;
+    vector<char> text(count * 11);
+    size_t length = 0, badCount = 0, rows = 0;
+    const double tFormat = measureMs([&]() {
+        length = formatDates(dates.data(), count, text.data());
+    });
+    const double tParse = measureMs([&]() {
+        rows = parseDates(text.data(), length, parsed.data(), nullptr, badCount);
+    });
+    assert( rows == (size_t) count && badCount == 0 && parsed == dates );
+
+    cout << "BENCH: " << count << " dates in a batch" << endl;
+    cout << "  formatDates " << tFormat << " ms" << endl;
+    cout << "  parseDates  " << tParse << " ms" << endl;
+}
+
+void benchmarkInvalid() {
+    const int count = 1000000;
+    mt19937 rng(42);
+    vector<int> fields;
+    for (int i = 0; i < count; i++) {
+        fields.push_back(2000 + rng() % 30);
+        fields.push_back(1 + rng() % 15);   // invalid months
+        fields.push_back(1 + rng() % 40);   // and even more invalid days
+    }
+    int validThrow = 0, validTry = 0;
+    const double tThrow = measureMs([&]() {
+        for (int i = 0; i < count; i++) {
+            try {
+                CDate d(fields[3 * i], fields[3 * i + 1], fields[3 * i + 2]);
+                validThrow++;
+            } catch (const invalid_argument &) {}
+        }
+    });
+    const double tTry = measureMs([&]() {
+        for (int i = 0; i < count; i++)
+            validTry += (bool) CDate::tryMake(fields[3 * i], fields[3 * i + 1], fields[3 * i + 2]);
+    });
+    assert( validThrow == validTry );
+
+    cout << "BENCH: " << count << " dates, " << count - validTry << " invalid" << endl;
+    cout << "  constructor + catch " << tThrow << " ms" << endl;
+    cout << "  tryMake             " << tTry << " ms" << endl;
+}
+
+void benchmarkCalendar() {
+    CBusinessCalendar cal;
+    const CDate first(2000, 1, 1);
+    for (int i = 0; i < 30 * 365; i += 37) cal.addHoliday(first + i);
+    mt19937 rng(42);
+    const int count = 20000;
+    vector<int> offsets, spans;
+    for (int i = 0; i < count; i++) {
+        offsets.push_back(rng() % (20 * 365));
+        spans.push_back(rng() % 2000);
+    }
+    long long sumNaive = 0, sumFast = 0;
+    const double tNaive = measureMs([&]() {
+        for (int i = 0; i < count; i++) {
+            CDate day = first + offsets[i];
+            for (int left = spans[i]; left > 0; )
+                if (cal.isWorkingDay(++day)) left--;
+            sumNaive += day - first;
+        }
+    });
+    const double tFast = measureMs([&]() {
+        for (int i = 0; i < count; i++)
+            sumFast += cal.addWorkingDays(first + offsets[i], spans[i]) - first;
+    });
+    assert( sumNaive == sumFast );
+
+    cout << "BENCH: " << count << " x addWorkingDays up to 2000 days" << endl;
+    cout << "  day by day   " << tNaive << " ms" << endl;
+    cout << "  rank lookup  " << tFast << " ms" << endl;
+}
+
+void benchmarkSort() {
+    const int count = 5000000;
+    mt19937 rng(42);
+    vector<CDate> dates;
+    dates.reserve(count);
+    const CDate first(1900, 1, 1);
+    for (int i = 0; i < count; i++) dates.push_back(first + (int) (rng() % 100000));
+
+    const double tSort = measureMs([&]() { sort(dates.begin(), dates.end()); });
+    assert( is_sorted(dates.begin(), dates.end()) );
+    const CDate low(1950, 1, 1), high(2000, 12, 31);
+    int inRange = 0;
+    const double tScan = measureMs([&]() {
+        for (int rep = 0; rep < 10; rep++)
+            for (const auto & d : dates) inRange += low <= d && d <= high;
+    });
+    assert( inRange > 0 );
+
+    cout << "BENCH: " << count << " dates, sizeof(CDate) = " << sizeof(CDate) << endl;
+    cout << "  sort           " << tSort << " ms" << endl;
+    cout << "  10 range scans " << tScan << " ms" << endl;
+}
+#endif /* BENCHMARK */
+
 int main ( void ) {
     testIsLeap();
     testLeapInInterval();
     testDayConversion();
+    testDateFormat();
+    testBatch();
+    testTryMake();
+    testBusinessCalendar();
     testProgrest();
-    //testProgtestBonusTest();
+    testProgtestBonusTest();
+#ifdef BENCHMARK
+    benchmarkDays();
+    benchmarkSort();
+    benchmarkFormat();
+    benchmarkBatch();
+    benchmarkInvalid();
+    benchmarkCalendar();
+#endif /* BENCHMARK */
     cout << "All tests PASSED!" << endl;
 
     return EXIT_SUCCESS;
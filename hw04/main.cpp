@@ -5,53 +5,68 @@
 #include <cstdio>
 #include <cstdint>
 #include <iostream>
+#include <type_traits>
+#include <new>
+#include <thread>
+#include <string>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <unistd.h>
 using namespace std;
 #endif /* __PROGTEST__ */
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /**
  * Represents a shared pointer
  * shares resources among many destinations
- * uses counting references internally
+ * the data and the reference counter live in one allocation,
+ * the counter is atomic, so copies can be owned by different threads
  * no arrays suppored as type T!
  */
 template<typename T>
 class SPtr {
     private:
-        /**
-         * Used for reference counting
-         * shared among more shared pointers
-         */
-        class Counter {
-            public:
-                size_t counter = 0;
+        /** Data stored together with the number of owners */
+        struct Block {
+            size_t mCount;
+            T mData;
+            template<typename... Args>
+            Block(Args &&... args) : mCount(1), mData(forward<Args>(args)...) {}
         };
-        // data stored
-        T * mPtr;
-        // common counter
-        Counter * mCnt;
+        // shared block, nullptr for an empty pointer
+        Block * mBlock = nullptr;
+        explicit SPtr(Block * block) : mBlock(block) {}
     public:
-        /** Constructs an empty shared pointer*/
-        SPtr() : mPtr(nullptr), mCnt(new Counter) { mCnt -> counter ++; }
-        /** Constructs a normal pointer holding shared pointer
-         * pointer gets delete after no shared points at it */
-        SPtr(T * ptr) : mPtr(ptr), mCnt(new Counter) { mCnt -> counter ++; }
+        /** Shared pointers are moved by memcpy in a Vector */
+        typedef void Relocatable;
+        /** Constructs an empty shared pointer, allocates nothing */
+        SPtr() {}
+        SPtr(decltype(nullptr)) {}
+        /** Constructs the data shared by the new pointer
+         * @param args constructor arguments of the data
+         */
+        template<typename... Args>
+        static SPtr make(Args &&... args) {
+            return SPtr(new Block(forward<Args>(args)...));
+        }
         /** Copies internal data, increases reefrence counter */
-        SPtr(const SPtr & src) {
-            mPtr = src.mPtr;
-            mCnt = src.mCnt;
-            mCnt -> counter ++;
-        }
-        /** Moves internal data, increases reefrence counter */
-        SPtr(SPtr && src) {
-            if (&src == this) return;
-            mPtr = src.mPtr;
-            mCnt = src.mCnt;
-            src.mCnt = nullptr;
-            src.mPtr = nullptr;
+        SPtr(const SPtr & src) : mBlock(src.mBlock) {
+            // a new owner is made from an existing one, nothing to order
+            if (mBlock != nullptr) __atomic_fetch_add(&mBlock -> mCount, 1, __ATOMIC_RELAXED);
         }
+        /** Moves internal data, the source gets empty */
+        SPtr(SPtr && src) : mBlock(src.mBlock) { src.mBlock = nullptr; }
         SPtr & operator = (SPtr src) {
-            std::swap(mPtr, src.mPtr);
-            std::swap(mCnt, src.mCnt);
+            std::swap(mBlock, src.mBlock);
             return *this;
         }
         /**
@@ -59,39 +74,50 @@ class SPtr {
          * is no other reference to it
          */
         ~SPtr() {
-            if (mCnt != nullptr) {
-                mCnt -> counter --;
-                if (mCnt -> counter == 0) {
-                    delete mCnt;
-                    delete mPtr;
-                }
-            } else delete mPtr;
-            mCnt = nullptr;
-            mPtr = nullptr;
+            // the last owner has to see all the writes of the other ones
+            if (mBlock != nullptr && __atomic_sub_fetch(&mBlock -> mCount, 1, __ATOMIC_ACQ_REL) == 0)
+                delete mBlock;
+            mBlock = nullptr;
         }
-        T & operator *  () const { return *mPtr; }
-        T * operator -> () const { return mPtr; }
+        T & operator *  () const { return mBlock -> mData; }
+        T * operator -> () const { return &mBlock -> mData; }
+        /** @return the data pointed to, nullptr for an empty pointer */
+        T * get() const { return mBlock == nullptr ? nullptr : &mBlock -> mData; }
         bool operator == (const SPtr & other) const {
-            return mPtr == other.mPtr;
+            return mBlock == other.mBlock;
         }
         bool operator != (const SPtr & other) const {
-            return !(mPtr == other);
+            return mBlock != other.mBlock;
         }
         bool operator == (T * other) const {
-            return mPtr == other;
+            return get() == other;
         }
         bool operator != (T * other) const {
-            return !(mPtr == other);
+            return get() != other;
         }
         /**
          * @return if this shared counter is shared among 1 owner only
+         * the data can be written then, writes of former owners are visible
          */
-        bool hasOne() const { return mCnt -> counter == 1; }
+        bool hasOne() const {
+            return mBlock != nullptr && __atomic_load_n(&mBlock -> mCount, __ATOMIC_ACQUIRE) == 1;
+        }
 };
 
+/**
+ * Tells if items of a type can be moved in memory by memcpy
+ * true for trivially copyable types and types declaring
+ * a public Relocatable typedef (they hold no pointers to themselves)
+ */
+template<typename T, typename = void>
+struct IsRelocatable : is_trivially_copyable<T> {};
+template<typename T>
+struct IsRelocatable<T, typename T::Relocatable> : true_type {};
+
 /**
  * Replacement for basic std::vector<T>,
  * but with normal API (only necesarry API parts implemented)
+ * items live in raw storage, only the first size() slots are constructed
  */
 template<typename T>
 class Vector {
@@ -99,23 +125,18 @@ class Vector {
         T * mArray = nullptr;
         size_t mLen = 0, mCap = 0;
     public:
+        /** Vectors of vectors are moved by memcpy when growing */
+        typedef void Relocatable;
         /* Creates an empry vector */
         Vector() {}
-        /* Copies data from another vector using = operator */
+        /* Copies items from another vector, keeps its capacity */
         Vector(const Vector & other) {
-            mArray = new T [other.mLen];
-            mLen = other.mLen;
-            mCap = other.mLen;
-            for (size_t i = 0; i < other.mLen; i++)
-                mArray[i] = other.mArray[i];
+            reserve(other.mCap);
+            append(other.mArray, other.mLen);
         }
         /* Moves data from another vector */
-        Vector(Vector && other) {
-            if (&other == this) return;
-            delete [] mArray;
-            mArray = other.mArray;
-            mLen = other.mLen;
-            mCap = other.mCap;
+        Vector(Vector && other)
+            : mArray(other.mArray), mLen(other.mLen), mCap(other.mCap) {
             other.mArray = nullptr;
             other.mLen = 0;
             other.mCap = 0;
@@ -127,36 +148,132 @@ class Vector {
             return *this;
         }
         /** Clear all the internal data */
-        ~Vector() {
-            delete [] mArray;
-            mArray = nullptr;
-            mLen = 0;
-            mCap = 0;
-        }
-        /** Adds an item to a vector using copy = operator
+        ~Vector() { clear(); }
+        /** Adds an item to a vector using copy constructor
          * @param item item to copy and add
          * @return this vector
          */
         Vector & add(const T & item) {
-            expandToLen(mLen);
-            mArray[mLen++] = item;
+            emplace(item);
             return *this;
         }
-        /** Moves and adds an item to a vector using move = operator
+        /** Moves and adds an item to a vector using move constructor
          * @param item item to move
          * @return this vector
          */
         Vector & add(T && item) {
-            expandToLen(mLen);
-            mArray[mLen++] = item;
+            emplace(move(item));
+            return *this;
+        }
+        /** Constructs an item at the end of a vector
+         * arguments may refer to items of this vector
+         * @param args constructor arguments
+         * @return the new item
+         */
+        template<typename... Args>
+        T & emplace(Args &&... args) {
+            if (mLen == mCap) {
+                // the new item is built before the old ones move away
+                const size_t cap = grownCapacity(mLen + 1);
+                T * array = allocate(cap);
+                new (array + mLen) T(forward<Args>(args)...);
+                relocate(mArray, mLen, array);
+                deallocate(mArray);
+                mArray = array;
+                mCap = cap;
+            } else new (mArray + mLen) T(forward<Args>(args)...);
+            return mArray[mLen++];
+        }
+        /** Adds items to the end of a vector
+         * @param src items to copy, can NOT point into this vector
+         * @param n number of items
+         * @return this vector
+         */
+        Vector & append(const T * src, const size_t n) {
+            return assign(mLen, src, n);
+        }
+        /** Overwrites items from the position given, grows a vector if needed
+         * @param pos index of the first item to overwrite, at most size()
+         * @param src items to copy, can NOT point into this vector
+         * @param n number of items
+         * @return this vector
+         */
+        Vector & assign(const size_t pos, const T * src, const size_t n) {
+            assert(pos <= mLen);
+            if (n == 0) return *this;
+            if (pos + n > mCap) reserve(grownCapacity(pos + n));
+            if constexpr (is_trivially_copyable<T>::value)
+                memcpy(mArray + pos, src, n * sizeof(T));
+            else
+                for (size_t i = 0; i < n; i++) {
+                    if (pos + i < mLen) mArray[pos + i] = src[i];
+                    else new (mArray + pos + i) T(src[i]);
+                }
+            mLen = max(mLen, pos + n);
+            return *this;
+        }
+        /** Inserts an item before the position given
+         * @param pos index of the new item, at most size()
+         * @param item item to move in, can NOT be an item of this vector
+         * @return this vector
+         */
+        Vector & insert(const size_t pos, T item) {
+            assert(pos <= mLen);
+            if (mLen == mCap) reserve(grownCapacity(mLen + 1));
+            if constexpr (IsRelocatable<T>::value)
+                memmove(static_cast<void *>(mArray + pos + 1), static_cast<const void *>(mArray + pos),
+                        (mLen - pos) * sizeof(T));
+            else
+                for (size_t i = mLen; i > pos; i--) {
+                    new (mArray + i) T(move(mArray[i - 1]));
+                    mArray[i - 1].~T();
+                }
+            new (mArray + pos) T(move(item));
+            mLen++;
             return *this;
         }
+        /** Deletes items from the position given, keeps the order
+         * @param pos index of the first item to delete
+         * @param n number of items, range must be in bounds
+         * @return this vector
+         */
+        Vector & erase(const size_t pos, const size_t n) {
+            assert(pos + n <= mLen);
+            if (n == 0) return *this;
+            destroy(mArray + pos, n);
+            if constexpr (IsRelocatable<T>::value)
+                memmove(static_cast<void *>(mArray + pos), static_cast<const void *>(mArray + pos + n),
+                        (mLen - pos - n) * sizeof(T));
+            else
+                for (size_t i = pos; i + n < mLen; i++) {
+                    new (mArray + i) T(move(mArray[i + n]));
+                    mArray[i + n].~T();
+                }
+            mLen -= n;
+            return *this;
+        }
+        /** Copies items out of a vector, range must be in bounds
+         * @param pos index of the first item to copy
+         * @param dst where to store the items
+         * @param n number of items
+         */
+        void copyOut(const size_t pos, T * dst, const size_t n) const {
+            assert(pos + n <= mLen);
+            if (n == 0) return;
+            if constexpr (is_trivially_copyable<T>::value)
+                memcpy(dst, mArray + pos, n * sizeof(T));
+            else
+                for (size_t i = 0; i < n; i++)
+                    dst[i] = mArray[pos + i];
+        }
         /**
-         * Invalides/deletes data from index given
-         * @param index index to delete items from
+         * Deletes items from index given
+         * @param index index to delete items from, at most size()
          * @return this vector
          */
         Vector & dropFrom(size_t index) {
+            assert(index <= mLen);
+            destroy(mArray + index, mLen - index);
             mLen = index;
             return *this;
         }
@@ -167,7 +284,7 @@ class Vector {
          * @return witteable reference to a vector item requested
          */
         T & get(const size_t index) {
-            workAferEnd(index);
+            if (index >= mLen) setSize(index + 1);
             return mArray[index];
         }
         /** Gets an item on the index given
@@ -180,12 +297,14 @@ class Vector {
             return mArray[index];
         }
         /** Removes the last item in a vector
+         * vector can NOT be empty
          * @return the last item
          */
-        T & pop() {
-            T & toReturn = get(lastIndex());
-            mLen--;
-            return toReturn;
+        T pop() {
+            assert(mLen > 0);
+            T item = move(mArray[mLen - 1]);
+            dropFrom(mLen - 1);
+            return item;
         }
         /** Gets an item on the index given
          * index can be out of bounds
@@ -206,23 +325,38 @@ class Vector {
                 return;
             }
             if (mLen == mCap) return;
-            mCap = mLen;
-            applyNewCapacity();
+            applyNewCapacity(mLen);
         }
-        /** Sets vector size - prepares resources or invalidates old items
+        /** Prepares storage for items without constructing them
+         * @param cap number of items that fit without reallocation
+         */
+        void reserve(const size_t cap) {
+            if (cap > mCap) applyNewCapacity(cap);
+        }
+        /** Sets vector size - default constructs new items or deletes old ones
+         * items of trivial types are left uninitialized
          * @param newLen the new size of the vector
          */
         void setSize(const size_t newLen) {
-            expandToLen(newLen);
-            mLen = newLen;
+            if (newLen <= mLen) {
+                dropFrom(newLen);
+                return;
+            }
+            if (newLen > mCap) reserve(grownCapacity(newLen));
+            for (; mLen < newLen; mLen++)
+                new (mArray + mLen) T;
         }
-        /** Deletes all the items in a vector, invalides the data */
+        /** Deletes all the items in a vector, releases the storage */
         void clear() {
-            delete [] mArray;
+            destroy(mArray, mLen);
+            deallocate(mArray);
             mArray = nullptr;
             mLen = 0;
             mCap = 0;
         }
+        /** @return the underlying array, valid until the vector grows */
+        inline T * data() { return mArray; }
+        inline const T * data() const { return mArray; }
         /** @return index of the last item or 0 for empty list */
         size_t lastIndex() const { return isEmpty() ? 0 : mLen - 1; }
         /** @return the size of a vector */
@@ -230,31 +364,36 @@ class Vector {
         /** @return if a vector is empty */
         inline bool isEmpty() const { return mLen == 0; }
     private:
-        /** Prepares for more items */
-        void expandToLen(const size_t len) {
-            if (len >= mCap) {
-                do {
-                    mCap = mCap * 4 / 3 + 8;
-                } while(len >= mCap);
-                applyNewCapacity();
-            }
+        /** @return capacity for at least len items, grows by half */
+        size_t grownCapacity(const size_t len) const {
+            return max(len, mCap + mCap / 2 + 8);
         }
-        /** Moves items to a larger array */
-        void applyNewCapacity() {
-            T * newArray = new T [mCap];
-            for (size_t i = 0; i < mLen; i++)
-                newArray[i] = move(mArray[i]);
-            delete [] mArray;
+        /** Moves items to a new array of the capacity given */
+        void applyNewCapacity(const size_t cap) {
+            T * newArray = allocate(cap);
+            relocate(mArray, mLen, newArray);
+            deallocate(mArray);
             mArray = newArray;
+            mCap = cap;
         }
-        /** Gets ready for item manipulation out of bounds
-         * @param index index to work at, to get ready
-         */
-        void workAferEnd(const size_t index) {
-            if (index >= mLen) {
-                expandToLen(index + 1);
-                mLen = index + 1;
-            }
+        static T * allocate(const size_t cap) {
+            return static_cast<T *>(::operator new(cap * sizeof(T)));
+        }
+        static void deallocate(T * array) { ::operator delete(array); }
+        static void destroy(T * items, const size_t n) {
+            if constexpr (!is_trivially_destructible<T>::value)
+                for (size_t i = 0; i < n; i++) items[i].~T();
+        }
+        /** Moves items to uninitialized storage, the source is left unconstructed */
+        static void relocate(T * src, const size_t n, T * dst) {
+            if (n == 0) return;
+            if constexpr (IsRelocatable<T>::value)
+                memcpy(static_cast<void *>(dst), static_cast<const void *>(src), n * sizeof(T));
+            else
+                for (size_t i = 0; i < n; i++) {
+                    new (dst + i) T(move(src[i]));
+                    src[i].~T();
+                }
         }
     public:
         /**
@@ -264,7 +403,7 @@ class Vector {
                 T * ptr;
             public:
                 Iterator(T * p) : ptr(p) {}
-                T operator * () const {
+                T & operator * () const {
                     return *ptr;
                 }
                 Iterator& operator ++() {
@@ -292,6 +431,321 @@ class Vector {
  */
 typedef Vector<uint8_t> Buffer;
 
+/**
+ * File content split into fixed size pages
+ * pages are shared among copies of a buffer and cloned
+ * before the first write, so a copy costs the page table only
+ * the page table is split into shared groups the same way,
+ * so a copy touches one counter per GROUP_PAGES pages
+ */
+class PagedBuffer {
+    public:
+        static const size_t PAGE_SIZE = 4096, GROUP_PAGES = 64;
+    private:
+        /** One page of file data */
+        struct Page {
+            uint8_t mData[PAGE_SIZE];
+        };
+        /** Part of the page table, unused pages are empty */
+        struct Group {
+            SPtr<Page> mPages[GROUP_PAGES];
+        };
+        // groups of pages holding data, the last page may be used partly
+        Vector<SPtr<Group>> mGroups;
+        // number of valid bytes
+        size_t mLen = 0;
+    public:
+        /** @return the number of bytes stored */
+        inline size_t size() const { return mLen; }
+        /** @return if there are no data stored */
+        inline bool isEmpty() const { return mLen == 0; }
+        /** Gets a byte on the index given
+         * index can NOT be out of bounds
+         */
+        uint8_t operator[](const size_t index) const {
+            assert(index < mLen);
+            return page(index / PAGE_SIZE) -> mData[index % PAGE_SIZE];
+        }
+        /** Copies data out of the buffer, range must be in bounds
+         * @param pos where to start reading
+         * @param dst array to store data to
+         * @param bytes how many bytes to copy
+         */
+        void read(size_t pos, uint8_t * dst, size_t bytes) const {
+            assert(pos + bytes <= mLen);
+            while (bytes > 0) {
+                const size_t offset = pos % PAGE_SIZE;
+                const size_t chunk = min(bytes, PAGE_SIZE - offset);
+                memcpy(dst, page(pos / PAGE_SIZE) -> mData + offset, chunk);
+                pos += chunk;
+                dst += chunk;
+                bytes -= chunk;
+            }
+        }
+        /** Finds the first index in [pos, end) where the buffers differ
+         * groups and pages shared by both buffers are skipped without reading them
+         * @param other buffer to compare with, both must be at least end long
+         * @return index of the first difference or end if there is none
+         */
+        size_t firstDifference(const PagedBuffer & other, size_t pos, const size_t end) const {
+            const size_t groupSize = PAGE_SIZE * GROUP_PAGES;
+            while (pos < end) {
+                const size_t group = pos / groupSize;
+                if (mGroups[group] == other.mGroups[group]) {
+                    pos = min(end, (group + 1) * groupSize);
+                    continue;
+                }
+                const size_t index = pos / PAGE_SIZE, offset = pos % PAGE_SIZE;
+                const size_t chunk = min(end - pos, PAGE_SIZE - offset);
+                if (page(index) != other.page(index)) {
+                    const size_t found = firstMismatch(page(index) -> mData + offset,
+                            other.page(index) -> mData + offset, chunk);
+                    if (found < chunk) return pos + found;
+                }
+                pos += chunk;
+            }
+            return end;
+        }
+        /** Finds the first index in [pos, end) where the buffers are equal
+         * @param other buffer to compare with, both must be at least end long
+         * @return index of the first equal byte or end if there is none
+         */
+        size_t firstEquality(const PagedBuffer & other, size_t pos, const size_t end) const {
+            while (pos < end) {
+                const size_t index = pos / PAGE_SIZE, offset = pos % PAGE_SIZE;
+                const size_t chunk = min(end - pos, PAGE_SIZE - offset);
+                if (page(index) == other.page(index)) return pos;
+                const size_t found = firstMatch(page(index) -> mData + offset,
+                        other.page(index) -> mData + offset, chunk);
+                if (found < chunk) return pos + found;
+                pos += chunk;
+            }
+            return end;
+        }
+        /** Appends data of the buffer to a vector, range must be in bounds
+         * @param target vector to append to
+         * @param pos where to start reading
+         * @param bytes how many bytes to copy
+         */
+        void appendTo(Buffer & target, size_t pos, size_t bytes) const {
+            assert(pos + bytes <= mLen);
+            while (bytes > 0) {
+                const size_t offset = pos % PAGE_SIZE;
+                const size_t chunk = min(bytes, PAGE_SIZE - offset);
+                target.append(page(pos / PAGE_SIZE) -> mData + offset, chunk);
+                pos += chunk;
+                bytes -= chunk;
+            }
+        }
+        /** Copies data into the buffer, grows it if needed
+         * pos can NOT be after the end of the buffer
+         * @param pos where to start writing
+         * @param src where to read data from
+         * @param bytes how many bytes to copy
+         */
+        void write(size_t pos, const uint8_t * src, size_t bytes) {
+            assert(pos <= mLen);
+            if (pos + bytes > mLen) setSize(pos + bytes);
+            while (bytes > 0) {
+                const size_t offset = pos % PAGE_SIZE;
+                const size_t chunk = min(bytes, PAGE_SIZE - offset);
+                memcpy(writablePage(pos / PAGE_SIZE) + offset, src, chunk);
+                pos += chunk;
+                src += chunk;
+                bytes -= chunk;
+            }
+        }
+        /** Sets the buffer size, new bytes are not initialized
+         * @param newLen the new size of the buffer
+         */
+        void setSize(const size_t newLen) {
+            const size_t oldPages = pageCount();
+            const size_t pages = (newLen + PAGE_SIZE - 1) / PAGE_SIZE;
+            const size_t groups = (pages + GROUP_PAGES - 1) / GROUP_PAGES;
+            mGroups.dropFrom(min(groups, mGroups.size()));
+            // release pages past the end of the last group kept
+            if (pages < oldPages && pages % GROUP_PAGES != 0)
+                for (size_t i = pages; i < min(oldPages, groups * GROUP_PAGES); i++)
+                    writableSlot(i) = SPtr<Page>();
+            while (mGroups.size() < groups)
+                mGroups.add(SPtr<Group>::make());
+            for (size_t i = oldPages; i < pages; i++)
+                writableSlot(i) = SPtr<Page>::make();
+            mLen = newLen;
+        }
+        /** Invalidates data from the index given */
+        void dropFrom(const size_t index) {
+            if (index < mLen) setSize(index);
+        }
+        /** @return number of pages holding data */
+        inline size_t pageCount() const { return (mLen + PAGE_SIZE - 1) / PAGE_SIZE; }
+        /** @return number of pages not shared with the other buffer at the same index */
+        size_t pagesNotIn(const PagedBuffer & other) const {
+            size_t count = 0;
+            for (size_t i = 0; i < pageCount(); i++)
+                if (i >= other.pageCount() || page(i) != other.page(i)) count++;
+            return count;
+        }
+        /** Trims non needed allocated capacity of the page table */
+        void trimCapacity() { mGroups.trimCapacity(); }
+    private:
+        /**
+         * Finds the first index where the arrays differ
+         * Compares 64 or 16 bytes at once when AVX2 or SSE2 is available,
+         * the rest is compared by 8 byte words
+         */
+        static size_t firstMismatch(const uint8_t * a, const uint8_t * b, const size_t length) {
+            size_t i = 0;
+#if defined(__AVX2__)
+            for (; i + 64 <= length; i += 64) {
+                const __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + i)),
+                        _mm256_loadu_si256((const __m256i *) (b + i)));
+                const __m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + i + 32)),
+                        _mm256_loadu_si256((const __m256i *) (b + i + 32)));
+                if ((unsigned int) _mm256_movemask_epi8(_mm256_and_si256(lo, hi)) == 0xFFFFFFFFu) continue;
+                const unsigned int equal = _mm256_movemask_epi8(lo);
+                if (equal != 0xFFFFFFFFu) return i + __builtin_ctz(~equal);
+                return i + 32 + __builtin_ctz(~(unsigned int) _mm256_movemask_epi8(hi));
+            }
+#endif
+#if defined(__SSE2__)
+            for (; i + 16 <= length; i += 16) {
+                const unsigned int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                        _mm_loadu_si128((const __m128i *) (a + i)), _mm_loadu_si128((const __m128i *) (b + i))));
+                if (equal != 0xFFFFu) return i + __builtin_ctz(~equal);
+            }
+#endif
+            for (; i + 8 <= length; i += 8) {
+                uint64_t x, y;
+                memcpy(&x, a + i, 8);
+                memcpy(&y, b + i, 8);
+                if (x != y) break;
+            }
+            for (; i < length; i++)
+                if (a[i] != b[i]) return i;
+            return length;
+        }
+        /**
+         * Finds the first index where the arrays are equal
+         * Compares 32 or 16 bytes at once when AVX2 or SSE2 is available
+         */
+        static size_t firstMatch(const uint8_t * a, const uint8_t * b, const size_t length) {
+            size_t i = 0;
+#if defined(__AVX2__)
+            for (; i + 32 <= length; i += 32) {
+                const unsigned int equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                        _mm256_loadu_si256((const __m256i *) (a + i)), _mm256_loadu_si256((const __m256i *) (b + i))));
+                if (equal != 0) return i + __builtin_ctz(equal);
+            }
+#endif
+#if defined(__SSE2__)
+            for (; i + 16 <= length; i += 16) {
+                const unsigned int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                        _mm_loadu_si128((const __m128i *) (a + i)), _mm_loadu_si128((const __m128i *) (b + i))));
+                if (equal != 0) return i + __builtin_ctz(equal);
+            }
+#endif
+            for (; i < length; i++)
+                if (a[i] == b[i]) return i;
+            return length;
+        }
+        /** @return the page of the index given */
+        inline const SPtr<Page> & page(const size_t index) const {
+            return mGroups[index / GROUP_PAGES] -> mPages[index % GROUP_PAGES];
+        }
+        /** Gets a page table slot that is not shared with another buffer
+         * makes a private copy of a shared group
+         * @param index index of the page
+         * @return page slot that can be replaced
+         */
+        SPtr<Page> & writableSlot(const size_t index) {
+            SPtr<Group> & group = mGroups[index / GROUP_PAGES];
+            if (!group.hasOne())
+                group = SPtr<Group>::make(*group);
+            return group -> mPages[index % GROUP_PAGES];
+        }
+        /** Gets a page that is not shared with another buffer
+         * makes a private copy of a shared one
+         * @param index index of the page
+         * @return page data that can be written to
+         */
+        uint8_t * writablePage(const size_t index) {
+            SPtr<Page> & slot = writableSlot(index);
+            if (!slot.hasOne())
+                slot = SPtr<Page>::make(*slot);
+            return slot -> mData;
+        }
+};
+
+/**
+ * Set of byte ranges, kept sorted
+ * overlapping and touching ranges are merged together
+ */
+class IntervalSet {
+    public:
+        /** Range [mFrom, mTo) */
+        struct Interval {
+            size_t mFrom, mTo;
+        };
+    private:
+        Vector<Interval> mIntervals;
+    public:
+        /** Adds the range [from, to), empty ranges are ignored */
+        void add(const size_t from, const size_t to) {
+            if (from >= to) return;
+            // first interval that can be merged, usually the last one
+            size_t first = mIntervals.size();
+            while (first > 0 && mIntervals[first - 1].mTo >= from) {
+                if (mIntervals[first - 1].mFrom <= to) first--;
+                else {
+                    // an interval after the range, search the rest by bisection
+                    first = lowerBound(from);
+                    break;
+                }
+            }
+            size_t last = first;
+            Interval merged = { from, to };
+            for (; last < mIntervals.size() && mIntervals[last].mFrom <= to; last++) {
+                merged.mFrom = min(merged.mFrom, mIntervals[last].mFrom);
+                merged.mTo = max(merged.mTo, mIntervals[last].mTo);
+            }
+            if (first == last) mIntervals.insert(first, merged);
+            else {
+                mIntervals[first] = merged;
+                mIntervals.erase(first + 1, last - first - 1);
+            }
+        }
+        /** Calls f(gapFrom, gapTo) for every part of [from, to) not in the set, in order */
+        template<typename F>
+        void forEachGap(size_t from, const size_t to, F f) const {
+            for (size_t i = lowerBound(from); i < mIntervals.size() && from < to; i++) {
+                if (mIntervals[i].mFrom >= to) break;
+                if (mIntervals[i].mFrom > from) f(from, mIntervals[i].mFrom);
+                from = max(from, mIntervals[i].mTo);
+            }
+            if (from < to) f(from, to);
+        }
+        /** Removes all the ranges */
+        void clear() { mIntervals.dropFrom(0); }
+        /** @return number of disjoint ranges */
+        inline size_t size() const { return mIntervals.size(); }
+        /** @return if there is no range */
+        inline bool isEmpty() const { return mIntervals.isEmpty(); }
+        /** @return the index-th range ordered by position */
+        inline const Interval & operator[](const size_t index) const { return mIntervals[index]; }
+    private:
+        /** @return index of the first interval ending at from or later */
+        size_t lowerBound(const size_t from) const {
+            size_t lo = 0, hi = mIntervals.size();
+            while (lo < hi) {
+                const size_t mid = (lo + hi) / 2;
+                if (mIntervals[mid].mTo < from) lo = mid + 1;
+                else hi = mid;
+            }
+            return lo;
+        }
+};
+
 /** Represents a version change*/
 class Version {
     private:
@@ -305,8 +759,19 @@ class Version {
             public:
                 Change() : mIndex(0) {}
                 Change(size_t index) : mIndex(index) {}
+                typedef void Relocatable;
+                /** Copies data of another change lying inside this one
+                 * @param other change to copy
+                 * @param limit data from this index on are skipped
+                 */
+                void overlay(const Change & other, const size_t limit) {
+                    const size_t len = min(other.mBuffer.size(), limit - other.mIndex);
+                    mBuffer.assign(other.mIndex - mIndex, other.mBuffer.data(), len);
+                }
+                friend class Version;
                 friend class CFile;
                 friend ostream & operator<<(ostream & out, Version & data);
+                friend void benchmarkVector();
         };
         // where was a curson while making a version
         size_t mPos;
@@ -314,13 +779,60 @@ class Version {
         size_t mLen;
         // list of individual changes/patches
         Vector<Change> mChanges;
+        // the whole data of a checkpoint version, shares pages with the file
+        SPtr<PagedBuffer> mSnapshot;
+        // how many bytes the changes hold
+        size_t mBytes = 0;
+    public:
+        Version(size_t pos, size_t len, Vector<Change> & changes,
+                const SPtr<PagedBuffer> & snapshot = SPtr<PagedBuffer>())
+            : mPos(pos), mLen(len), mChanges(changes), mSnapshot(snapshot) { countBytes(); }
+        Version(size_t pos, size_t len, Vector<Change> && changes,
+                const SPtr<PagedBuffer> & snapshot = SPtr<PagedBuffer>())
+            : mPos(pos), mLen(len), mChanges(move(changes)), mSnapshot(snapshot) { countBytes(); }
+        /** @return if the version keeps its whole data */
+        bool isCheckpoint() const { return mSnapshot != nullptr; }
+        /**
+         * Joins two successive versions into one
+         * changes of the older one win, the newer ones past its length are dropped
+         * @param older version restoring the state the newer one is made from
+         * @param newer version made right after the older one
+         * @return version restoring the older state from the newer one
+         */
+        static SPtr<Version> merge(const Version & older, const Version & newer) {
+            IntervalSet ranges;
+            for (size_t i = 0; i < newer.mChanges.size(); i++) {
+                const Change & change = newer.mChanges[i];
+                if (change.mIndex < older.mLen)
+                    ranges.add(change.mIndex, min(change.mIndex + change.mBuffer.size(), older.mLen));
+            }
+            for (size_t i = 0; i < older.mChanges.size(); i++) {
+                const Change & change = older.mChanges[i];
+                ranges.add(change.mIndex, change.mIndex + change.mBuffer.size());
+            }
+            Vector<Change> changes;
+            changes.reserve(ranges.size());
+            // every change lies in one range, ranges and changes are sorted
+            size_t n = 0, o = 0;
+            for (size_t r = 0; r < ranges.size(); r++) {
+                Change & change = changes.emplace(ranges[r].mFrom);
+                change.mBuffer.setSize(ranges[r].mTo - ranges[r].mFrom);
+                for (; n < newer.mChanges.size() && newer.mChanges[n].mIndex < ranges[r].mTo; n++)
+                    change.overlay(newer.mChanges[n], older.mLen);
+                for (; o < older.mChanges.size() && older.mChanges[o].mIndex < ranges[r].mTo; o++)
+                    change.overlay(older.mChanges[o], older.mLen);
+            }
+            return SPtr<Version>::make(older.mPos, older.mLen, move(changes), older.mSnapshot);
+        }
+    private:
+        void countBytes() {
+            for (size_t i = 0; i < mChanges.size(); i++)
+                mBytes += mChanges[i].mBuffer.size();
+        }
     public:
-        Version(size_t pos, size_t len, Vector<Change> & changes)
-            : mPos(pos), mLen(len), mChanges(changes) {}
-        Version(size_t pos, size_t len, Vector<Change> && changes)
-            : mPos(pos), mLen(len), mChanges(changes) {}
         friend class CFile;
         friend ostream & operator<<(ostream & out, Version & data);
+        friend void benchmarkVector();
 };
 
 ostream & operator<<(ostream & out, Version & data) {
@@ -345,25 +857,56 @@ class CFile {
     // buffers of file content data
     // mCur - the current state
     // mLatest - state when addVerson was called
-    SPtr<Buffer> mCur = new Buffer, mLatest = new Buffer;
+    SPtr<PagedBuffer> mCur = SPtr<PagedBuffer>::make(), mLatest = SPtr<PagedBuffer>::make();
+    // ranges of mCur written to since addVersion,
+    // data outside of them are the same as in mLatest
+    IntervalSet mDirty;
+    // history limits, 0 for no limit
+    size_t mMaxVersions = 0, mMaxBytes = 0, mCheckpointEvery = 0;
+    // versions added since the last checkpoint
+    size_t mSinceCheckpoint = 0;
+    // bytes held by changes of all the versions
+    size_t mDeltaBytes = 0;
 
     public:
+    /** Memory used by a file and its history */
+    struct MemoryStats {
+        // versions that can be restored
+        size_t mVersions;
+        // versions keeping their whole data
+        size_t mCheckpoints;
+        // bytes held by changes of the versions
+        size_t mDeltaBytes;
+        // pages of the current data
+        size_t mPages;
+        // pages of the latest version and checkpoints not shared
+        // with the current data at the same position
+        size_t mHistoryPages;
+    };
+
     /** Creats an empty file buffer */
     CFile(void) {}
     /** Copies all the internal data as shared pointers when posible */
     CFile(const CFile & other)
         : mPos(other.mPos), mLatestPos(other.mLatestPos),
         mVersions(other.mVersions),
-        mCur(other.mCur), mLatest(other.mLatest) {}
+        mCur(other.mCur), mLatest(other.mLatest), mDirty(other.mDirty),
+        mMaxVersions(other.mMaxVersions), mMaxBytes(other.mMaxBytes),
+        mCheckpointEvery(other.mCheckpointEvery), mSinceCheckpoint(other.mSinceCheckpoint),
+        mDeltaBytes(other.mDeltaBytes) {}
     /** Moves all the internal data from another object */
     CFile(CFile && other)
         : mPos(other.mPos), mLatestPos(other.mLatestPos),
         mVersions(other.mVersions),
-        mCur(other.mCur), mLatest(other.mLatest) {
+        mCur(other.mCur), mLatest(other.mLatest), mDirty(other.mDirty),
+        mMaxVersions(other.mMaxVersions), mMaxBytes(other.mMaxBytes),
+        mCheckpointEvery(other.mCheckpointEvery), mSinceCheckpoint(other.mSinceCheckpoint),
+        mDeltaBytes(other.mDeltaBytes) {
             if (&other == this) return;
             other.mPos = 0;
             other.mLatestPos = 0;
             other.mVersions.clear();
+            other.mDeltaBytes = 0;
             other.mCur    = nullptr;
             other.mLatest = nullptr;
         }
@@ -373,6 +916,12 @@ class CFile {
         swap(mVersions, other.mVersions);
         swap(mCur, other.mCur);
         swap(mLatest, other.mLatest);
+        swap(mDirty, other.mDirty);
+        swap(mMaxVersions, other.mMaxVersions);
+        swap(mMaxBytes, other.mMaxBytes);
+        swap(mCheckpointEvery, other.mCheckpointEvery);
+        swap(mSinceCheckpoint, other.mSinceCheckpoint);
+        swap(mDeltaBytes, other.mDeltaBytes);
         return *this;
     }
     ~CFile() {}
@@ -392,11 +941,10 @@ class CFile {
      * @return how many bytes was actually read
      */
     uint32_t read(uint8_t * dst, uint32_t bytes) {
-        if (mCur -> isEmpty()) return 0;
-        size_t maxBound = min(mCur -> size(), mPos + bytes);
-        size_t read = 0;
-        for (; mPos < maxBound; mPos++, read++)
-            dst[read] = (*mCur)[mPos];
+        if (mPos >= mCur -> size()) return 0;
+        size_t read = min(mCur -> size() - mPos, (size_t) bytes);
+        mCur -> read(mPos, dst, read);
+        mPos += read;
         return read;
     }
     /** Write data to this file
@@ -406,16 +954,55 @@ class CFile {
      */
     uint32_t write(const uint8_t * src, uint32_t bytes) {
         checkWrite();
-        size_t end = mPos + bytes;
-        for (size_t read = 0; mPos < end; mPos++, read++)
-            (*mCur)[mPos] = src[read];
+        mCur -> write(mPos, src, bytes);
+        mDirty.add(mPos, mPos + bytes);
+        mPos += bytes;
         return bytes;
     }
+    /** Reads data into more arrays, like read called for each of them
+     * @param segments array of structures with iov_base and iov_len, e.g. iovec
+     * @param count number of segments
+     * @return how many bytes was actually read
+     */
+    template<typename IoVec>
+    uint32_t readv(const IoVec * segments, const size_t count) {
+        size_t read = 0;
+        for (size_t i = 0; i < count && mPos < mCur -> size(); i++) {
+            const size_t len = min(mCur -> size() - mPos, (size_t) segments[i].iov_len);
+            mCur -> read(mPos, (uint8_t *) segments[i].iov_base, len);
+            mPos += len;
+            read += len;
+        }
+        return read;
+    }
+    /** Writes data of more arrays one after another, like write called for each
+     * the buffer is checked for sharing and resized once for all of them
+     * @param segments array of structures with iov_base and iov_len, e.g. iovec
+     * @param count number of segments
+     * @return how many byte has been written
+     */
+    template<typename IoVec>
+    uint32_t writev(const IoVec * segments, const size_t count) {
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++) total += segments[i].iov_len;
+        if (total == 0) return 0;
+        checkWrite();
+        if (mPos + total > mCur -> size()) mCur -> setSize(mPos + total);
+        size_t pos = mPos;
+        for (size_t i = 0; i < count; i++) {
+            mCur -> write(pos, (const uint8_t *) segments[i].iov_base, segments[i].iov_len);
+            pos += segments[i].iov_len;
+        }
+        mDirty.add(mPos, pos);
+        mPos = pos;
+        return total;
+    }
     /**
      * Cuts data from the current cursor position
      */
     void truncate(void) {
         checkWrite();
+        mDirty.add(mPos, mCur -> size());
         mCur -> dropFrom(mPos);
     }
     /** Returns how many bytes are in a file
@@ -426,64 +1013,116 @@ class CFile {
     void addVersion(void) {
         Vector<Version::Change> changes;
         if (mLatest == mCur) {
-            mVersions.add(new Version(mLatestPos, mLatest -> size(), move(changes)));
+            storeVersion(move(changes));
             mLatestPos = mPos;
             return;
         }
-        bool inChange = false;
-        Version::Change current;
-        size_t maxLen = min(mLatest->size(), mCur -> size());
-        for (size_t i = 0; i < maxLen; i++) {
-            if ((*mLatest)[i] != (*mCur)[i]) {
-                if (!inChange) {
-                    current = Version::Change(i);
-                    inChange = true;
-                }
-                current.mBuffer.add((*mLatest)[i]);
-            } else {
-                if (inChange) {
-                    current.mBuffer.trimCapacity();
-                    changes.add(move(current));
-                    inChange = false;
+        // only written ranges can differ, touching ones are merged,
+        // so no change spans two of them
+        const size_t maxLen = min(mLatest->size(), mCur -> size());
+        size_t tail = maxLen;
+        for (size_t d = 0; d < mDirty.size() && mDirty[d].mFrom < maxLen; d++) {
+            const size_t to = min(mDirty[d].mTo, maxLen);
+            size_t i = mLatest -> firstDifference(*mCur, mDirty[d].mFrom, to);
+            while (i < to) {
+                const size_t end = mLatest -> firstEquality(*mCur, i, to);
+                // the truncated tail continues a change reaching the end
+                if (end == maxLen && maxLen < mLatest -> size()) {
+                    tail = i;
+                    break;
                 }
+                addChange(changes, i, end);
+                i = mLatest -> firstDifference(*mCur, end, to);
             }
         }
-        if(mLatest->size() > mCur -> size()) {
-            if (!inChange) {
-                current = Version::Change(mLatest->size());
-                inChange = true;
-            }
-            for (size_t i = mCur -> size(); i < mLatest -> size(); i++)
-                current.mBuffer.add((*mLatest)[i]);
-        }
-        if (inChange) {
-            current.mBuffer.trimCapacity();
-            changes.add(move(current));
-            inChange = false;
-        }
-        mVersions.add(new Version(mLatestPos, mLatest -> size(), move(changes)));
+        if (tail < mLatest -> size()) addChange(changes, tail, mLatest -> size());
+        storeVersion(move(changes));
         mLatest = mCur;
         mLatestPos = mPos;
+        mDirty.clear();
     }
     /** Restores the lates version of a file stored */
-    bool undoVersion(void) {
-        if (mVersions.isEmpty()) return false;
+    bool undoVersion(void) { return undoVersions(1); }
+    /**
+     * Does the same as count calls of undoVersion, all or nothing
+     * starts from the closest checkpoint when there is one on the way
+     * @param count how many versions to undo
+     * @return false if there are less versions stored
+     */
+    bool undoVersions(const size_t count) {
+        if (count == 0 || count > mVersions.size()) return false;
+        const size_t target = mVersions.size() - count;
 
-        mCur = mLatest;
-        mPos = mLatestPos;
-        mCur -> trimCapacity();
+        // the new current data are those of the version after the target
+        size_t from = mVersions.size();
+        for (size_t i = target + 1; i < mVersions.size(); i++)
+            if (mVersions[i] -> isCheckpoint()) {
+                from = i;
+                break;
+            }
+        mCur = from == mVersions.size() ? mLatest : mVersions[from] -> mSnapshot;
+        if (from > target + 1) {
+            mCur = SPtr<PagedBuffer>::make(*mCur);
+            for (size_t i = from - 1; i > target; i--)
+                applyVersion(*mCur, *mVersions[i]);
+        }
+        mPos = count == 1 ? mLatestPos : mVersions[target + 1] -> mPos;
+        // other copies may read a shared buffer, only an own one can be trimmed
+        if (mCur.hasOne()) mCur -> trimCapacity();
 
+        mLatest = mCur;
         checkWriteLatest();
-        Version & version = *(mVersions.pop());
-        mLatest->setSize(version.mLen);
+        const Version & version = *mVersions[target];
+        applyVersion(*mLatest, version);
         mLatestPos = version.mPos;
-        for (const Version::Change & change : version.mChanges) {
-            writeToBuffer(*mLatest, change.mIndex, change.mBuffer);
+        // the restored data are the only ones the buffers differ in
+        mDirty.clear();
+        for (size_t i = 0; i < version.mChanges.size(); i++) {
+            const Version::Change & change = version.mChanges[i];
+            mDirty.add(change.mIndex, change.mIndex + change.mBuffer.size());
         }
+        // checkWriteLatest() has made it our own
         mLatest -> trimCapacity();
+        for (size_t i = target; i < mVersions.size(); i++)
+            mDeltaBytes -= mVersions[i] -> mBytes;
+        mVersions.dropFrom(target);
         mVersions.trimCapacity();
+        mSinceCheckpoint = min(mSinceCheckpoint, mVersions.size());
         return true;
     }
+    /**
+     * Limits the version history, applied on every addVersion
+     * when there are too many versions, pairs of adjacent versions
+     * in the older half are merged, the oldest data stay reachable
+     * when the changes hold too many bytes, the oldest versions are dropped
+     * @param maxVersions most versions kept, 0 for no limit
+     * @param maxBytes most bytes kept in changes, 0 for no limit
+     */
+    void limitHistory(const size_t maxVersions, const size_t maxBytes) {
+        mMaxVersions = maxVersions;
+        mMaxBytes = maxBytes;
+        compactHistory();
+    }
+    /**
+     * Makes every n-th added version a checkpoint keeping its whole data,
+     * it shares pages with other versions, so only its page table is new
+     * @param every distance of checkpoints, 0 for none
+     */
+    void setCheckpointInterval(const size_t every) {
+        mCheckpointEvery = every;
+        mSinceCheckpoint = 0;
+    }
+    /** @return memory used by this file and its history */
+    MemoryStats memoryStats() const {
+        MemoryStats stats = { mVersions.size(), 0, mDeltaBytes, mCur -> pageCount(), 0 };
+        if (!(mLatest == mCur)) stats.mHistoryPages += mLatest -> pagesNotIn(*mCur);
+        for (size_t i = 0; i < mVersions.size(); i++)
+            if (mVersions[i] -> isCheckpoint()) {
+                stats.mCheckpoints++;
+                stats.mHistoryPages += mVersions[i] -> mSnapshot -> pagesNotIn(*mCur);
+            }
+        return stats;
+    }
     /** Prints both internal buffers to the stream given
      * uses 2 lines, is ended by a new line and flush
      * @param out stream to print data to
@@ -499,40 +1138,363 @@ class CFile {
         out << endl;
     }
     private:
+    /** Adds a version restoring mLatest, keeps the history limits */
+    void storeVersion(Vector<Version::Change> && changes) {
+        SPtr<PagedBuffer> snapshot;
+        if (mCheckpointEvery != 0 && ++mSinceCheckpoint >= mCheckpointEvery) {
+            snapshot = mLatest;
+            mSinceCheckpoint = 0;
+        }
+        mVersions.add(SPtr<Version>::make(mLatestPos, mLatest -> size(), move(changes), snapshot));
+        mDeltaBytes += mVersions[mVersions.lastIndex()] -> mBytes;
+        compactHistory();
+    }
+    /** Merges and drops versions exceeding the history limits */
+    void compactHistory() {
+        // undo ends at the data of the second version, merging a pair
+        // loses the data of its newer version, so the first two are kept apart
+        if (mMaxVersions != 0 && mVersions.size() > mMaxVersions) {
+            // merge pairs in the older half, the newer half is kept untouched
+            const size_t half = mVersions.size() / 2;
+            size_t kept = 1;
+            for (size_t i = 1; i < half; i += 2, kept++) {
+                if (i + 1 == half) {
+                    mVersions[kept] = mVersions[i];
+                    continue;
+                }
+                mDeltaBytes -= mVersions[i] -> mBytes + mVersions[i + 1] -> mBytes;
+                mVersions[kept] = Version::merge(*mVersions[i], *mVersions[i + 1]);
+                mDeltaBytes += mVersions[kept] -> mBytes;
+            }
+            mVersions.erase(kept, half - kept);
+        }
+        if (mMaxVersions != 0 && mVersions.size() > mMaxVersions) {
+            // a limit too small to be halved, merge the oldest versions
+            const size_t extra = mVersions.size() - mMaxVersions;
+            const size_t base = mMaxVersions == 1 ? 0 : 1;
+            for (size_t i = base + 1; i <= base + extra; i++) {
+                mDeltaBytes -= mVersions[base] -> mBytes + mVersions[i] -> mBytes;
+                mVersions[base] = Version::merge(*mVersions[base], *mVersions[i]);
+                mDeltaBytes += mVersions[base] -> mBytes;
+            }
+            mVersions.erase(base + 1, extra);
+        }
+        size_t drop = 0;
+        while (mMaxBytes != 0 && mDeltaBytes > mMaxBytes && drop < mVersions.size())
+            mDeltaBytes -= mVersions[drop++] -> mBytes;
+        mVersions.erase(0, drop);
+    }
+    /** Restores older data of a buffer from the version given */
+    void applyVersion(PagedBuffer & target, const Version & version) {
+        target.setSize(version.mLen);
+        for (size_t i = 0; i < version.mChanges.size(); i++)
+            writeToBuffer(target, version.mChanges[i].mIndex, version.mChanges[i].mBuffer);
+    }
+    /** Stores the latest data in the range given as a new change
+     * the change buffer is allocated to the exact size
+     */
+    void addChange(Vector<Version::Change> & changes, const size_t from, const size_t to) const {
+        Version::Change & change = changes.emplace(from);
+        change.mBuffer.reserve(to - from);
+        mLatest -> appendTo(change.mBuffer, from, to - from);
+    }
     /** Writes data to a buffer at position
      * @param target where to write data to
      * @param pos from where shloud be data written to
      * @param where data should be read from
      * @return how many bytes was written
      */
-    uint32_t writeToBuffer(Buffer & target, size_t pos, const Buffer & src) {
-        size_t end = pos + src.size();
-        for (size_t read = 0; pos < end; pos++, read++)
-            target[pos] = src[read];
+    uint32_t writeToBuffer(PagedBuffer & target, size_t pos, const Buffer & src) {
+        target.write(pos, src.data(), src.size());
         return src.size();
     }
     /** Resolves if current buffer can be written
      * to without editing another file copied from thisone.
      * Checks shared pointer, if it has only 1 reference.
-     * Otherwise makes a deep copy */
+     * Otherwise copies the page table, pages stay shared */
     void checkWrite() {
         if (mCur.hasOne()) return;
-        Buffer * copy = new Buffer;
-        *copy = *mCur;
-        mCur = SPtr(copy);
+        mCur = SPtr<PagedBuffer>::make(*mCur);
     }
     /** Resolves if latest buffer can be written
      * to without editing another file copied from thisone.
      * Checks shared pointer, if it has only 1 reference.
-     * Otherwise makes a deep copy */
+     * Otherwise copies the page table, pages stay shared */
     void checkWriteLatest() {
         if (mLatest.hasOne()) return;
-        Buffer * copy = new Buffer;
-        *copy = *mLatest;
-        mLatest = SPtr(copy);
+        mLatest = SPtr<PagedBuffer>::make(*mLatest);
     }
 };
 
+#ifndef __PROGTEST__
+/**
+ * CFile kept on disk, not a part of the ProgTest submission
+ *
+ * The current data live in a memory mapped data file, so they can be larger
+ * than the memory. Versions are kept in an append-only journal: before a byte
+ * of the latest version is overwritten or truncated for the first time, its
+ * old value is appended as a change record. addVersion then only appends
+ * a commit record pointing to those changes, undoVersion copies them back.
+ *
+ * Records of one version are linked by offsets of the previous record and
+ * commits are linked the same way, a small header at the start of the journal
+ * points to the heads of both lists. Opening a store reads the header and
+ * the changes since the last version only, no matter how long the history is.
+ */
+class CPersistentFile {
+    public:
+        CPersistentFile(void) {}
+        CPersistentFile(const CPersistentFile &) = delete;
+        CPersistentFile & operator = (const CPersistentFile &) = delete;
+        ~CPersistentFile() { close(); }
+
+        bool open(const string & dataFile, const string & journalFile);
+        void close(void);
+
+        bool seek(uint32_t offset);
+        uint32_t read(uint8_t * dst, uint32_t bytes);
+        uint32_t write(const uint8_t * src, uint32_t bytes);
+        void truncate(void);
+        uint32_t fileSize(void) const { return mHeader.mLen; }
+        void addVersion(void);
+        bool undoVersion(void);
+    private:
+        enum RecordType : uint64_t { CHANGE, COMMIT };
+        struct Header {
+            char mMagic[8];
+            // offsets of the last commit and the last change not commited yet
+            uint64_t mVersionHead, mPendingHead;
+            // where the next record goes
+            uint64_t mEnd;
+            // the current data
+            uint64_t mLen, mPos;
+            // the latest version
+            uint64_t mLatestLen, mLatestPos;
+        };
+        /**
+         * a change is followed by mLen old bytes from mIndex,
+         * a commit stores the version it restores: mIndex is the head
+         * of its changes, mLen and mPos the length and the cursor
+         */
+        struct Record {
+            uint64_t mType, mPrev, mIndex, mLen, mPos;
+        };
+
+        int mDataFd = -1, mJournalFd = -1;
+        bool mOpened = false;
+        uint8_t * mData = nullptr;
+        size_t mCapacity = 0;
+        Header mHeader = {};
+        // ranges with old bytes saved since the latest version
+        IntervalSet mSaved;
+
+        bool fail(void);
+        bool reserve(const size_t len);
+        bool saveOld(const size_t from, const size_t to);
+        bool restore(uint64_t head, const uint64_t len);
+        bool loadSaved(uint64_t head);
+        uint64_t append(const Record & record, const uint8_t * data);
+        bool readRecord(const uint64_t offset, Record & record) const;
+        bool writeHeader(void);
+};
+
+static const char JOURNAL_MAGIC[8] = { 'C', 'F', 'I', 'L', 'E', 'J', 'R', '1' };
+
+/**
+ * Opens a store, creates an empty one if neither the journal nor data exist
+ * Returns false if the files can not be used, a data file without
+ * a journal is left untouched
+ */
+bool CPersistentFile::open(const string & dataFile, const string & journalFile) {
+    close();
+    mDataFd = ::open(dataFile.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (mDataFd < 0 || fstat(mDataFd, &st) != 0) return fail();
+    mJournalFd = ::open(journalFile.c_str(), O_RDWR | (st.st_size == 0 ? O_CREAT : 0), 0644);
+    if (mJournalFd < 0) return fail();
+    const ssize_t got = pread(mJournalFd, &mHeader, sizeof(mHeader), 0);
+    if (got == 0) {
+        if (st.st_size != 0) return fail();
+        memcpy(mHeader.mMagic, JOURNAL_MAGIC, sizeof(mHeader.mMagic));
+        mHeader.mEnd = sizeof(mHeader);
+        if (!writeHeader()) return fail();
+    } else if (got != (ssize_t) sizeof(mHeader)
+            || memcmp(mHeader.mMagic, JOURNAL_MAGIC, sizeof(mHeader.mMagic)) != 0
+            || (uint64_t) st.st_size < mHeader.mLen)
+        return fail();
+    if (st.st_size > 0) {
+        void * data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, mDataFd, 0);
+        if (data == MAP_FAILED) return fail();
+        mData = (uint8_t *) data;
+        mCapacity = st.st_size;
+    }
+    if (!loadSaved(mHeader.mPendingHead)) return fail();
+    mOpened = true;
+    return true;
+}
+/** Unmaps the data, the store can be opened again later */
+void CPersistentFile::close(void) {
+    if (mOpened) {
+        writeHeader();
+        // drop the spare capacity of the mapping
+        if (ftruncate(mDataFd, mHeader.mLen) != 0) {}
+    }
+    fail();
+}
+/** Releases everything without touching the files, returns false */
+bool CPersistentFile::fail(void) {
+    if (mData != nullptr) munmap(mData, mCapacity);
+    if (mDataFd >= 0) ::close(mDataFd);
+    if (mJournalFd >= 0) ::close(mJournalFd);
+    mData = nullptr;
+    mCapacity = 0;
+    mDataFd = mJournalFd = -1;
+    mOpened = false;
+    mHeader = Header();
+    mSaved.clear();
+    return false;
+}
+
+/** The cursor is stored with the next modification or on close */
+bool CPersistentFile::seek(uint32_t offset) {
+    if (offset > mHeader.mLen) return false;
+    mHeader.mPos = offset;
+    return true;
+}
+uint32_t CPersistentFile::read(uint8_t * dst, uint32_t bytes) {
+    if (mHeader.mPos >= mHeader.mLen) return 0;
+    const size_t read = min(mHeader.mLen - mHeader.mPos, (uint64_t) bytes);
+    memcpy(dst, mData + mHeader.mPos, read);
+    mHeader.mPos += read;
+    return read;
+}
+uint32_t CPersistentFile::write(const uint8_t * src, uint32_t bytes) {
+    const size_t end = mHeader.mPos + bytes;
+    if (!mOpened || bytes == 0 || !saveOld(mHeader.mPos, end) || !reserve(end)) return 0;
+    memcpy(mData + mHeader.mPos, src, bytes);
+    mHeader.mPos = end;
+    mHeader.mLen = max(mHeader.mLen, (uint64_t) end);
+    return writeHeader() ? bytes : 0;
+}
+void CPersistentFile::truncate(void) {
+    if (!mOpened || !saveOld(mHeader.mPos, mHeader.mLen)) return;
+    mHeader.mLen = mHeader.mPos;
+    writeHeader();
+}
+void CPersistentFile::addVersion(void) {
+    if (!mOpened) return;
+    const Record commit = { COMMIT, mHeader.mVersionHead, mHeader.mPendingHead,
+        mHeader.mLatestLen, mHeader.mLatestPos };
+    const uint64_t offset = append(commit, nullptr);
+    if (offset == 0) return;
+    mHeader.mVersionHead = offset;
+    mHeader.mPendingHead = 0;
+    mHeader.mLatestLen = mHeader.mLen;
+    mHeader.mLatestPos = mHeader.mPos;
+    mSaved.clear();
+    writeHeader();
+}
+/**
+ * Puts the saved bytes back to get the latest version,
+ * then the changes of the popped commit become the saved ones
+ */
+bool CPersistentFile::undoVersion(void) {
+    Record commit;
+    if (!mOpened || mHeader.mVersionHead == 0 || !readRecord(mHeader.mVersionHead, commit)) return false;
+    if (!restore(mHeader.mPendingHead, mHeader.mLatestLen) || !loadSaved(commit.mIndex)) return false;
+    mHeader.mLen = mHeader.mLatestLen;
+    mHeader.mPos = mHeader.mLatestPos;
+    mHeader.mVersionHead = commit.mPrev;
+    mHeader.mPendingHead = commit.mIndex;
+    mHeader.mLatestLen = commit.mLen;
+    mHeader.mLatestPos = commit.mPos;
+    return writeHeader();
+}
+
+/** Grows the mapping to at least len bytes, keeps the old one if it can not */
+bool CPersistentFile::reserve(const size_t len) {
+    if (len <= mCapacity) return true;
+    const size_t capacity = max(len, max(mCapacity * 2, (size_t) 1 << 16));
+    if (ftruncate(mDataFd, capacity) != 0) return false;
+    void * data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, mDataFd, 0);
+    if (data == MAP_FAILED) {
+        if (ftruncate(mDataFd, mCapacity) != 0) {}
+        return false;
+    }
+    if (mData != nullptr) munmap(mData, mCapacity);
+    mData = (uint8_t *) data;
+    mCapacity = capacity;
+    return true;
+}
+/**
+ * Appends old bytes of the latest version in [from, to) not saved yet,
+ * the records are linked from the header on disk before the data can change
+ */
+bool CPersistentFile::saveOld(const size_t from, size_t to) {
+    // bytes past these ends are not a part of the latest version any more
+    to = min(to, min(mHeader.mLen, mHeader.mLatestLen));
+    const uint64_t end = mHeader.mEnd;
+    bool ok = true;
+    mSaved.forEachGap(from, to, [this, &ok](const size_t gapFrom, const size_t gapTo) {
+        const Record change = { CHANGE, mHeader.mPendingHead, gapFrom, gapTo - gapFrom, 0 };
+        const uint64_t offset = ok ? append(change, mData + gapFrom) : 0;
+        if (offset == 0) ok = false;
+        else mHeader.mPendingHead = offset;
+    });
+    if (ok && mHeader.mEnd != end) ok = writeHeader() && fdatasync(mJournalFd) == 0;
+    if (ok) mSaved.add(from, to);
+    return ok;
+}
+/** Sets the data length and copies bytes of the changes given back */
+bool CPersistentFile::restore(uint64_t head, const uint64_t len) {
+    if (!reserve(len)) return false;
+    for (Record change; head != 0; head = change.mPrev) {
+        // old bytes are saved only from the latest version
+        if (!readRecord(head, change) || change.mType != CHANGE || change.mIndex + change.mLen > len)
+            return false;
+        if (pread(mJournalFd, mData + change.mIndex, change.mLen, head + sizeof(Record)) != (ssize_t) change.mLen)
+            return false;
+    }
+    return true;
+}
+/** Collects ranges of the changes given */
+bool CPersistentFile::loadSaved(uint64_t head) {
+    mSaved.clear();
+    for (Record change; head != 0; head = change.mPrev) {
+        if (!readRecord(head, change) || change.mType != CHANGE) return false;
+        mSaved.add(change.mIndex, change.mIndex + change.mLen);
+    }
+    return true;
+}
+/** @return offset of the record appended to the journal, 0 on failure */
+uint64_t CPersistentFile::append(const Record & record, const uint8_t * data) {
+    const uint64_t offset = mHeader.mEnd;
+    if (pwrite(mJournalFd, &record, sizeof(record), offset) != (ssize_t) sizeof(record)) return 0;
+    if (record.mType == CHANGE
+            && pwrite(mJournalFd, data, record.mLen, offset + sizeof(record)) != (ssize_t) record.mLen)
+        return 0;
+    mHeader.mEnd += sizeof(record) + (record.mType == CHANGE ? record.mLen : 0);
+    return offset;
+}
+/**
+ * Reads a record, false if it or the bytes of a change do not fit the journal,
+ * records link only to the earlier ones, so no chain can loop
+ */
+bool CPersistentFile::readRecord(const uint64_t offset, Record & record) const {
+    if (offset < sizeof(Header) || offset > mHeader.mEnd || mHeader.mEnd - offset < sizeof(record)
+            || pread(mJournalFd, &record, sizeof(record), offset) != (ssize_t) sizeof(record)
+            || record.mPrev >= offset)
+        return false;
+    if (record.mType == COMMIT) return true;
+    return record.mType == CHANGE && record.mLen <= mHeader.mEnd - offset - sizeof(record)
+        && record.mLen <= UINT64_MAX - record.mIndex;
+}
+/** The header is the only part of the journal rewritten in place */
+bool CPersistentFile::writeHeader(void) {
+    return mJournalFd >= 0 && pwrite(mJournalFd, &mHeader, sizeof(mHeader), 0) == (ssize_t) sizeof(mHeader);
+}
+#endif /* __PROGTEST__ */
+
 #ifndef __PROGTEST__
 bool writeTest(CFile & x, const initializer_list<uint8_t> & data, uint32_t wrLen) {
     return x.write(data.begin (), data.size ()) == wrLen;
@@ -563,7 +1525,738 @@ bool readTest(CFile & x, const initializer_list<uint8_t> & data, uint32_t rdLen)
     return true;
 }
 
+void testVectorSpans() {
+    const uint8_t bytes[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+    Buffer buf;
+    buf.append(bytes, 10).append(bytes, 3);
+    assert( buf.size() == 13 && buf[12] == 3 );
+    buf.assign(11, bytes + 5, 5);
+    assert( buf.size() == 16 && buf[10] == 1 && buf[11] == 6 && buf[15] == 10 );
+    buf.assign(0, bytes + 9, 1);
+    assert( buf.size() == 16 && buf[0] == 10 && buf[1] == 2 );
+    uint8_t out[4];
+    buf.copyOut(12, out, 4);
+    assert( memcmp(out, bytes + 6, 4) == 0 );
+
+    const Buffer parts[] = { buf, Buffer().append(bytes, 2) };
+    Vector<Buffer> nested;
+    nested.append(parts, 2).assign(1, parts, 1);
+    assert( nested.size() == 2 && nested[1].size() == 16 );
+    Buffer copies[2];
+    nested.copyOut(0, copies, 2);
+    assert( copies[0].size() == 16 && copies[0][15] == 10 );
+}
+
+void testVectorStorage() {
+    Vector<Buffer> buffers;
+    Buffer buf;
+    buf.add(1).add(2);
+    for (int i = 0; i < 100; i++) {
+        buffers.add(buf);
+        buffers.add(buffers[0]);  // copied before the vector grows
+    }
+    assert( buffers.size() == 200 && buffers[199].size() == 2 && buffers[199][1] == 2 );
+    buffers.add(move(buf));
+    assert( buf.isEmpty() && buffers[200].size() == 2 );
+    Buffer popped = buffers.pop();
+    assert( popped.size() == 2 && buffers.size() == 200 );
+    buffers.emplace().add(5);
+    assert( buffers[200][0] == 5 );
+    buffers[250].add(6);
+    assert( buffers.size() == 251 && buffers[249].isEmpty() );
+    buffers.setSize(3);
+    buffers.trimCapacity();
+    Vector<Buffer> copy(buffers);
+    copy.add(popped);
+    assert( copy.size() == 4 && buffers.size() == 3 && copy[3][0] == 1 );
+
+    Vector<SPtr<Buffer>> shared;
+    SPtr<Buffer> ptr = SPtr<Buffer>::make();
+    for (int i = 0; i < 50; i++) shared.add(ptr);
+    shared.dropFrom(1);
+    assert( !ptr.hasOne() );
+    shared.clear();
+    assert( ptr.hasOne() );
+}
+
+void testIntervalSet() {
+    IntervalSet set;
+    set.add(10, 20);
+    set.add(30, 40);
+    set.add(50, 60);
+    set.add(5, 5);
+    assert( set.size() == 3 );
+    set.add(0, 2);
+    set.add(25, 27);
+    assert( set.size() == 5 && set[0].mTo == 2 && set[2].mFrom == 25 );
+    set.add(20, 25);
+    assert( set.size() == 4 && set[1].mFrom == 10 && set[1].mTo == 27 );
+    set.add(1, 55);
+    assert( set.size() == 1 && set[0].mFrom == 0 && set[0].mTo == 60 );
+    set.add(70, 80);
+    set.add(61, 62);
+    assert( set.size() == 3 && set[1].mFrom == 61 );
+    set.clear();
+    assert( set.isEmpty() );
+}
+
+void testPages() {
+    const size_t len = 3 * PagedBuffer::PAGE_SIZE + 100;
+    uint8_t data[len], tmp[len];
+    for (size_t i = 0; i < len; i++) data[i] = i * 7;
+
+    CFile a;
+    assert( a.write(data, len) == len );
+    a.addVersion();
+    CFile b(a);
+    uint8_t patch[200];
+    memset(patch, 0xAB, sizeof(patch));
+    assert( b.seek(PagedBuffer::PAGE_SIZE - 100) );
+    assert( b.write(patch, sizeof(patch)) == sizeof(patch) );
+
+    assert( a.seek(0) && a.read(tmp, len) == len );
+    assert( memcmp(tmp, data, len) == 0 );
+    assert( b.seek(0) && b.read(tmp, len) == len );
+    assert( memcmp(tmp, data, PagedBuffer::PAGE_SIZE - 100) == 0 );
+    assert( memcmp(tmp + PagedBuffer::PAGE_SIZE - 100, patch, sizeof(patch)) == 0 );
+    assert( memcmp(tmp + PagedBuffer::PAGE_SIZE + 100, data + PagedBuffer::PAGE_SIZE + 100,
+                   len - PagedBuffer::PAGE_SIZE - 100) == 0 );
+
+    assert( b.seek(10) );
+    b.truncate();
+    assert( b.fileSize() == 10 && a.fileSize() == len );
+    b.addVersion();
+    assert( b.seek(5) && b.write(data, len) == len );
+    assert( b.fileSize() == len + 5 );
+    assert( b.undoVersion() );
+    assert( b.fileSize() == 10 );
+    assert( b.undoVersion() );
+    assert( b.seek(0) && b.read(tmp, len) == len );
+    assert( memcmp(tmp, data, len) == 0 );
+}
+
+#ifdef BENCHMARK
+#include <chrono>
+#include <vector>
+
+template <class F>
+double measureMs(F f) {
+    const auto start = chrono::steady_clock::now();
+    f();
+    const auto end = chrono::steady_clock::now();
+    return chrono::duration<double, milli>(end - start).count();
+}
+
+void benchmarkCopyOnWrite() {
+    const size_t len = 64 << 20, copies = 20;
+    uint8_t * data = new uint8_t [len];
+    for (size_t i = 0; i < len; i++) data[i] = i;
+    CFile file;
+    const double tWrite = measureMs([&]() { file.write(data, len); });
+    const double tRead = measureMs([&]() { file.seek(0); file.read(data, len); });
+    const double tCopy = measureMs([&]() {
+        for (size_t i = 0; i < copies; i++) {
+            CFile copy(file);
+            const uint8_t byte = i;
+            copy.seek(len / 2);
+            copy.write(&byte, 1);
+        }
+    });
+    delete [] data;
+
+    cout << "BENCH: " << (len >> 20) << " MB file" << endl;
+    cout << "  write                  " << tWrite << " ms" << endl;
+    cout << "  read                   " << tRead << " ms" << endl;
+    cout << "  " << copies << "x copy + 1 B write  " << tCopy << " ms" << endl;
+}
+
+void benchmarkVersions() {
+    const size_t len = 16 << 20;
+    uint8_t * data = new uint8_t [len];
+    for (size_t i = 0; i < len; i++) data[i] = i;
+    CFile file;
+    file.write(data, len);
+    file.addVersion();
+    for (size_t i = 0; i < len; i++) data[i] = i * 3;
+    file.seek(0);
+    file.write(data, len);
+    const double tAdd = measureMs([&]() { file.addVersion(); });
+    const double tUndo = measureMs([&]() { file.undoVersion(); });
+
+    // every write touches a page, few bytes change
+    file.addVersion();
+    for (size_t i = 0; i < len; i += len / 100) {
+        file.seek(i);
+        data[i + 10]++;
+        file.write(data + i, 64);
+    }
+    const double tSparse = measureMs([&]() { file.addVersion(); });
+    delete [] data;
+
+    cout << "BENCH: " << (len >> 20) << " MB file rewritten" << endl;
+    cout << "  addVersion             " << tAdd << " ms" << endl;
+    cout << "  undoVersion            " << tUndo << " ms" << endl;
+    cout << "  addVersion, 100 writes " << tSparse << " ms" << endl;
+}
+
+/** Makes edits of an editor like workload, each is 3 small writes and addVersion */
+void editFile(CFile & file, const size_t edits, unsigned int & seed) {
+    for (size_t i = 0; i < edits; i++) {
+        for (int w = 0; w < 3; w++) {
+            seed = seed * 1103515245 + 12345;
+            const uint8_t text[8] = { (uint8_t) seed, 1, 2, 3, 4, 5, 6, 7 };
+            file.seek((seed >> 4) % (file.fileSize() - 8));
+            file.write(text, sizeof(text));
+        }
+        file.addVersion();
+    }
+}
+
+void benchmarkEditing() {
+    const size_t len = 8 << 20, edits = 5000;
+    uint8_t * data = new uint8_t [len];
+    for (size_t i = 0; i < len; i++) data[i] = i;
+    CFile file;
+    file.write(data, len);
+    file.addVersion();
+    unsigned int seed = 1;
+    CFile limited(file);
+    const double tEdit = measureMs([&]() { editFile(file, edits, seed); });
+    const CFile::MemoryStats stats = file.memoryStats();
+    const double tUndo = measureMs([&]() { while (file.undoVersion()) {} });
+
+    seed = 1;
+    limited.limitHistory(500, 0);
+    limited.setCheckpointInterval(100);
+    const double tLimited = measureMs([&]() { editFile(limited, edits, seed); });
+    const CFile::MemoryStats limitedStats = limited.memoryStats();
+    const double tJump = measureMs([&]() { limited.undoVersions(limited.memoryStats().mVersions); });
+    delete [] data;
+
+    cout << "BENCH: " << (len >> 20) << " MB file, " << edits << "x (3 small writes + addVersion)" << endl;
+    cout << "  edit                   " << tEdit << " ms, " << stats.mVersions << " versions, "
+         << stats.mDeltaBytes << " B of changes" << endl;
+    cout << "  undo all               " << tUndo << " ms" << endl;
+    cout << "  edit, 500 versions max " << tLimited << " ms, " << limitedStats.mVersions << " versions, "
+         << limitedStats.mCheckpoints << " checkpoints, " << limitedStats.mDeltaBytes << " B of changes, "
+         << limitedStats.mHistoryPages << " history pages" << endl;
+    cout << "  undoVersions(all)      " << tJump << " ms" << endl;
+}
+
+void benchmarkPersistent() {
+    const string dataFile = "bench_data", journalFile = "bench_journal";
+    remove(dataFile.c_str());
+    remove(journalFile.c_str());
+    const size_t len = 8 << 20, edits = 20000;
+    uint8_t * data = new uint8_t [len];
+    for (size_t i = 0; i < len; i++) data[i] = i;
+    CPersistentFile store;
+    store.open(dataFile, journalFile);
+    store.write(data, len);
+    store.addVersion();
+    delete [] data;
+    unsigned int seed = 1;
+    const double tEdit = measureMs([&]() {
+        for (size_t i = 0; i < edits; i++) {
+            for (int w = 0; w < 3; w++) {
+                seed = seed * 1103515245 + 12345;
+                const uint8_t text[8] = { (uint8_t) seed, 1, 2, 3, 4, 5, 6, 7 };
+                store.seek((seed >> 4) % (len - 8));
+                store.write(text, sizeof(text));
+            }
+            store.addVersion();
+        }
+    });
+    store.close();
+    const double tOpen = measureMs([&]() { store.open(dataFile, journalFile); });
+    const double tUndo = measureMs([&]() { for (int i = 0; i < 1000; i++) store.undoVersion(); });
+    store.close();
+    remove(dataFile.c_str());
+    remove(journalFile.c_str());
+
+    cout << "BENCH: persistent " << (len >> 20) << " MB file, " << edits << "x (3 small writes + addVersion)" << endl;
+    cout << "  edit                   " << tEdit << " ms" << endl;
+    cout << "  open                   " << tOpen << " ms" << endl;
+    cout << "  1000x undoVersion      " << tUndo << " ms" << endl;
+}
+
+void benchmarkVectored() {
+    const size_t records = 1000000, batch = 64;
+    uint8_t record[16];
+    memset(record, 42, sizeof(record));
+    iovec segments[batch];
+    for (size_t i = 0; i < batch; i++) segments[i] = { record, sizeof(record) };
+    CFile single, batched;
+    const double tSingle = measureMs([&]() {
+        for (size_t i = 0; i < records; i++) single.write(record, sizeof(record));
+    });
+    const double tBatched = measureMs([&]() {
+        for (size_t i = 0; i < records; i += batch) batched.writev(segments, batch);
+    });
+    assert( single.fileSize() == batched.fileSize() );
+
+    cout << "BENCH: " << records << " writes of " << sizeof(record) << " B" << endl;
+    cout << "  write                  " << tSingle << " ms" << endl;
+    cout << "  writev by " << batch << "           " << tBatched << " ms" << endl;
+}
+
+template <class T, class Make>
+void benchmarkVectorOf(const char * name, const size_t count, Make make) {
+    const T item = make();
+    size_t sizes = 0;
+    const double tStd = measureMs([&]() {
+        for (int round = 0; round < 5; round++) {
+            vector<T> v;
+            for (size_t i = 0; i < count; i++) v.push_back(item);
+            sizes += v.size();
+        }
+    });
+    const double tOwn = measureMs([&]() {
+        for (int round = 0; round < 5; round++) {
+            Vector<T> v;
+            for (size_t i = 0; i < count; i++) v.add(item);
+            sizes += v.size();
+        }
+    });
+    assert( sizes == 10 * count );
+    cout << "  " << name << ": std::vector " << tStd << " ms, Vector " << tOwn << " ms" << endl;
+}
+
+void benchmarkVector() {
+    cout << "BENCH: 5x add of copies into an empty vector" << endl;
+    benchmarkVectorOf<uint8_t>("10M uint8_t       ", 10000000, []() { return (uint8_t) 42; });
+    benchmarkVectorOf<SPtr<Version>>("1M SPtr<Version>  ", 1000000, []() {
+        return SPtr<Version>::make(0, 0, Vector<Version::Change>());
+    });
+    Version::Change change(7);
+    change.mBuffer.add(1);
+    benchmarkVectorOf<Version::Change>("1M Change         ", 1000000, [&]() { return change; });
+}
+#endif /* BENCHMARK */
+
+/** Compares a file content and cursor with the expected ones */
+bool sameFile(const CFile & file, const Buffer & data, const size_t pos) {
+    CFile copy(file);
+    Buffer tmp;
+    tmp.setSize(data.size() + 1);
+    if (copy.read(tmp.data(), data.size() + 1) != data.size() - pos) return false;
+    if (!copy.seek(0) || copy.read(tmp.data(), data.size() + 1) != data.size()) return false;
+    return data.isEmpty() || memcmp(tmp.data(), data.data(), data.size()) == 0;
+}
+
+void testVersionsRandom() {
+    const size_t page = PagedBuffer::PAGE_SIZE;
+    unsigned int seed = 11;
+    auto next = [&seed](const size_t range) {
+        seed = seed * 1103515245 + 12345;
+        return (size_t) (seed >> 8) % range;
+    };
+    CFile file;
+    // model of the file, the state at the last addVersion and older ones
+    Buffer cur, latest;
+    size_t pos = 0, latestPos = 0;
+    Vector<Buffer> history;
+    Vector<size_t> posHistory;
+    for (int step = 0; step < 3000; step++) {
+        const size_t op = next(10);
+        if (op < 6) {
+            pos = next(cur.size() + 1);
+            assert( file.seek(pos) );
+            Buffer data;
+            const size_t len = next(4) == 0 ? next(3 * page) : next(100);
+            const uint8_t value = next(256);
+            for (size_t i = 0; i < len; i++)
+                data.add(next(3) == 0 ? value + i : value);
+            assert( file.write(data.data(), len) == len );
+            cur.assign(pos, data.data(), len);
+            pos += len;
+        } else if (op == 6) {
+            pos = next(cur.size() + 1);
+            assert( file.seek(pos) );
+            file.truncate();
+            cur.dropFrom(pos);
+        } else if (op < 9) {
+            file.addVersion();
+            history.add(latest);
+            posHistory.add(latestPos);
+            latest = cur;
+            latestPos = pos;
+        } else {
+            assert( file.undoVersion() == !history.isEmpty() );
+            if (!history.isEmpty()) {
+                cur = latest;
+                pos = latestPos;
+                latest = history.pop();
+                latestPos = posHistory.pop();
+            }
+        }
+        assert( sameFile(file, cur, pos) );
+    }
+}
+
+/** @return the whole data of a file */
+Buffer content(const CFile & file) {
+    CFile copy(file);
+    Buffer data;
+    data.setSize(file.fileSize());
+    copy.seek(0);
+    copy.read(data.data(), data.size());
+    return data;
+}
+
+bool sameData(const Buffer & a, const Buffer & b) {
+    return a.size() == b.size() && (a.isEmpty() || memcmp(a.data(), b.data(), a.size()) == 0);
+}
+
+/** Writes some bytes and adds a version, returns the data stored */
+Buffer editAndAdd(CFile & file, const size_t step) {
+    uint8_t data[100];
+    memset(data, step, sizeof(data));
+    file.seek(step * 37 % (file.fileSize() + 1));
+    file.write(data, step % 3 == 0 ? 100 : 10);
+    if (step % 5 == 0 && file.seek(file.fileSize() / 2)) file.truncate();
+    file.addVersion();
+    return content(file);
+}
+
+void testHistory() {
+    // multi step undo matches single steps, with and without checkpoints
+    for (size_t every = 0; every < 4; every++) {
+        CFile file;
+        file.setCheckpointInterval(every);
+        for (size_t step = 1; step <= 12; step++) editAndAdd(file, step);
+        file.write((const uint8_t *) "xyz", 3);
+        assert( file.memoryStats().mCheckpoints == (every == 0 ? 0 : 12 / every) );
+        assert( !CFile(file).undoVersions(13) );
+        for (size_t count = 1; count <= 12; count++) {
+            CFile a(file), b(file);
+            assert( a.undoVersions(count) );
+            for (size_t i = 0; i < count; i++) b.undoVersion();
+            assert( sameData(content(a), content(b)) );
+            const uint8_t byte = 7;
+            assert( a.write(&byte, 1) == 1 && b.write(&byte, 1) == 1 );
+            assert( sameData(content(a), content(b)) );
+            a.addVersion();
+            b.addVersion();
+            assert( a.undoVersions(2) == b.undoVersions(2) );
+            assert( sameData(content(a), content(b)) );
+        }
+    }
+
+    // count limit merges versions, the oldest state stays reachable
+    CFile file;
+    file.limitHistory(5, 0);
+    Vector<Buffer> states;
+    states.add(content(file));
+    for (size_t step = 1; step <= 20; step++) {
+        states.add(editAndAdd(file, step));
+        assert( file.memoryStats().mVersions <= 5 );
+    }
+    size_t last = states.size();
+    while (file.undoVersion()) {
+        const Buffer data = content(file);
+        size_t found = last;
+        while (found > 0 && !sameData(states[found - 1], data)) found--;
+        assert( found > 0 );
+        last = found - 1;
+    }
+    // undo ends at the data of the first addVersion
+    assert( last == 1 );
+
+    // byte budget drops the oldest versions, the newest are intact
+    CFile budget;
+    budget.limitHistory(0, 300);
+    states.clear();
+    states.add(content(budget));
+    for (size_t step = 1; step <= 30; step++) {
+        states.add(editAndAdd(budget, step));
+        assert( budget.memoryStats().mDeltaBytes <= 300 );
+    }
+    size_t undone = 0;
+    for (; budget.undoVersion(); undone++)
+        assert( sameData(content(budget), states[states.size() - 1 - undone]) );
+    assert( undone > 2 && undone < 30 );
+    assert( budget.memoryStats().mDeltaBytes == 0 );
+}
+
+void testSharedPointer() {
+    SPtr<Buffer> empty;
+    assert( empty == nullptr && !empty.hasOne() );
+    SPtr<Buffer> a = SPtr<Buffer>::make();
+    a -> add(1);
+    SPtr<Buffer> b(a);
+    assert( a == b && !a.hasOne() && b -> size() == 1 );
+    SPtr<Buffer> c(move(b));
+    assert( b == nullptr && c != nullptr && !c.hasOne() );
+    a = empty;
+    assert( c.hasOne() && a == nullptr );
+}
+
+/** Copies of a file are edited by more threads at once */
+void testThreads() {
+    const size_t len = 5 * PagedBuffer::PAGE_SIZE;
+    Buffer data;
+    for (size_t i = 0; i < len; i++) data.add(i);
+    CFile file;
+    file.write(data.data(), len);
+    file.addVersion();
+
+    const int threads = 8;
+    bool ok[threads];
+    Vector<thread> workers;
+    for (int t = 0; t < threads; t++)
+        workers.emplace([&ok, t](CFile copy) {
+            ok[t] = true;
+            for (int round = 0; round < 50; round++) {
+                const uint8_t byte = t;
+                copy.seek((round * 997 + t * 4099) % copy.fileSize());
+                copy.write(&byte, 1);
+                copy.addVersion();
+                CFile again(copy);
+                ok[t] = ok[t] && again.undoVersion();
+            }
+            for (int round = 0; round < 50; round++)
+                ok[t] = ok[t] && copy.undoVersion();
+        }, file);
+    for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+    for (int t = 0; t < threads; t++) assert( ok[t] );
+    assert( sameData(content(file), data) );
+
+    // a page table grown step by step has spare capacity, undo on copies
+    // must not trim it while another copy reads the same buffer
+    CFile grown;
+    Buffer big;
+    for (size_t i = 0; i < 6 * 64; i++) {
+        const uint8_t page[PagedBuffer::PAGE_SIZE] = { (uint8_t) i };
+        grown.write(page, sizeof(page));
+        big.append(page, sizeof(page));
+    }
+    grown.addVersion();
+    Vector<thread> undoers;
+    for (int t = 0; t < 2; t++)
+        undoers.emplace([&ok, t](const CFile & shared) {
+            for (int round = 0; round < 20; round++) {
+                CFile copy(shared);
+                ok[t] = copy.undoVersion();
+            }
+        }, grown);
+    CFile reader(grown);
+    bool same = true;
+    for (int round = 0; round < 20; round++)
+        same = same && sameData(content(reader), big);
+    for (size_t t = 0; t < undoers.size(); t++) undoers[t].join();
+    assert( ok[0] && ok[1] && same );
+}
+
+/** Same operations on a CFile and a store reopened from time to time */
+Buffer storeContent(CPersistentFile & store) {
+    Buffer data;
+    data.setSize(store.fileSize());
+    store.seek(0);
+    store.read(data.data(), data.size());
+    return data;
+}
+
+Buffer fileContent(const string & name) {
+    Buffer data;
+    FILE * f = fopen(name.c_str(), "rb");
+    if (f == nullptr) return data;
+    uint8_t chunk[4096];
+    for (size_t got; (got = fread(chunk, 1, sizeof(chunk), f)) > 0; )
+        data.append(chunk, got);
+    fclose(f);
+    return data;
+}
+
+void testPersistent() {
+    const string dataFile = "test_data", journalFile = "test_journal";
+    remove(dataFile.c_str());
+    remove(journalFile.c_str());
+    CFile file;
+    CPersistentFile store;
+    assert( store.open(dataFile, journalFile) );
+    unsigned int seed = 5;
+    auto next = [&seed](const size_t range) {
+        seed = seed * 1103515245 + 12345;
+        return (size_t) (seed >> 8) % range;
+    };
+    Buffer tmp1, tmp2;
+    tmp1.setSize(20000);
+    tmp2.setSize(20000);
+    for (int step = 0; step < 2000; step++) {
+        const size_t op = next(12);
+        if (op < 6) {
+            const size_t pos = next(file.fileSize() + 1);
+            assert( file.seek(pos) && store.seek(pos) );
+            uint8_t data[3000];
+            const size_t len = next(4) == 0 ? next(sizeof(data)) : next(50);
+            memset(data, next(256), len);
+            assert( file.write(data, len) == len && store.write(data, len) == len );
+        } else if (op == 6) {
+            const size_t pos = next(file.fileSize() + 1);
+            assert( file.seek(pos) && store.seek(pos) );
+            file.truncate();
+            store.truncate();
+        } else if (op < 9) {
+            file.addVersion();
+            store.addVersion();
+        } else if (op < 11) {
+            assert( file.undoVersion() == store.undoVersion() );
+        } else {
+            store.close();
+            assert( store.open(dataFile, journalFile) );
+        }
+        assert( file.fileSize() == store.fileSize() );
+        // the cursors match when both read the same
+        const size_t read = file.read(tmp1.data(), tmp1.size());
+        assert( store.read(tmp2.data(), tmp2.size()) == read );
+        assert( memcmp(tmp1.data(), tmp2.data(), read) == 0 );
+        assert( file.seek(0) && store.seek(0) );
+        assert( file.read(tmp1.data(), tmp1.size()) == store.read(tmp2.data(), tmp2.size()) );
+        assert( memcmp(tmp1.data(), tmp2.data(), file.fileSize()) == 0 );
+    }
+    while (file.undoVersion()) {
+        assert( store.undoVersion() );
+        assert( file.seek(0) && store.seek(0) );
+        assert( file.read(tmp1.data(), tmp1.size()) == store.read(tmp2.data(), tmp2.size()) );
+        assert( memcmp(tmp1.data(), tmp2.data(), file.fileSize()) == 0 );
+    }
+    assert( !store.undoVersion() );
+    store.close();
+
+    assert( store.open(dataFile, journalFile) );
+    assert( store.fileSize() == file.fileSize() );
+    // a failed growth keeps the data readable
+    struct stat dataStat, journalStat;
+    assert( stat(dataFile.c_str(), &dataStat) == 0 && stat(journalFile.c_str(), &journalStat) == 0 );
+    rlimit oldLimit, limit;
+    getrlimit(RLIMIT_FSIZE, &oldLimit);
+    limit = oldLimit;
+    limit.rlim_cur = dataStat.st_size + journalStat.st_size + 4096;
+    Buffer before = storeContent(store), big;
+    big.setSize(limit.rlim_cur);
+    void (*oldHandler)(int) = signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    assert( store.seek(store.fileSize()) );
+    const uint32_t written = store.write(big.data(), big.size());
+    setrlimit(RLIMIT_FSIZE, &oldLimit);
+    signal(SIGXFSZ, oldHandler);
+    assert( written == 0 && sameData(storeContent(store), before) );
+    const uint8_t byte = 7;
+    assert( store.seek(store.fileSize()) && store.write(&byte, 1) == 1 );
+    assert( sameData(storeContent(store), before.append(&byte, 1)) );
+    store.seek(store.fileSize() - 1);
+    store.truncate();
+    store.close();
+    // a different file is not a journal and neither file is changed
+    const Buffer dataBytes = fileContent(dataFile), journalBytes = fileContent(journalFile);
+    assert( dataBytes.size() > 0 && journalBytes.size() > 0 );
+    assert( !store.open(journalFile, dataFile) );
+    assert( sameData(fileContent(dataFile), dataBytes) && sameData(fileContent(journalFile), journalBytes) );
+    // data without its journal are not replaced by an empty store
+    const string missingJournal = "test_missing_journal";
+    remove(missingJournal.c_str());
+    assert( !store.open(dataFile, missingJournal) );
+    assert( sameData(fileContent(dataFile), dataBytes) && access(missingJournal.c_str(), F_OK) != 0 );
+    assert( store.open(dataFile, journalFile) && sameData(storeContent(store), content(file)) );
+    // an empty data file does not make an empty journal of the data
+    assert( store.seek(0) );
+    store.truncate();
+    store.close();
+    const Buffer emptyJournal = fileContent(journalFile);
+    assert( !store.open(journalFile, dataFile) );
+    assert( sameData(fileContent(journalFile), emptyJournal) );
+    remove(dataFile.c_str());
+    remove(journalFile.c_str());
+}
+
+/** Changes out of the data or out of the journal are refused, not applied */
+void testCorruptedJournal() {
+    const string dataFile = "test_data", journalFile = "test_journal";
+    remove(dataFile.c_str());
+    remove(journalFile.c_str());
+    CPersistentFile store;
+    assert( store.open(dataFile, journalFile) );
+    assert( store.write(nullptr, 0) == 0 && store.fileSize() == 0 );
+    Buffer data, changed;
+    data.setSize(100);
+    for (size_t i = 0; i < data.size(); i++) data[i] = i;
+    changed = data;
+    memset(changed.data(), 0xff, 10);
+    assert( store.write(data.data(), data.size()) == data.size() );
+    store.addVersion();
+    assert( store.seek(0) && store.write(changed.data(), 10) == 10 );
+    store.close();
+
+    // the header, the commit, then the change saving the first 10 bytes
+    const long changeIndex = 64 + 40 + 16, changeLen = changeIndex + 8;
+    const struct { long mOffset; uint64_t mValue; bool mOpens; } corruptions[] = {
+        { changeIndex, 200, true },             // old bytes out of the data
+        { changeIndex, UINT64_MAX - 4, false }, // range wrapping around
+        { changeLen, 1 << 20, false },          // old bytes out of the journal
+        { changeIndex - 8, 104, false },        // change linked to itself
+    };
+    for (const auto & corruption : corruptions) {
+        const Buffer journal = fileContent(journalFile);
+        FILE * f = fopen(journalFile.c_str(), "r+b");
+        assert( f && fseek(f, corruption.mOffset, SEEK_SET) == 0 );
+        assert( fwrite(&corruption.mValue, sizeof(corruption.mValue), 1, f) == 1 );
+        fclose(f);
+        assert( store.open(dataFile, journalFile) == corruption.mOpens );
+        if (corruption.mOpens) {
+            assert( !store.undoVersion() );
+            assert( sameData(storeContent(store), changed) );
+            store.close();
+        }
+        f = fopen(journalFile.c_str(), "wb");
+        assert( f && fwrite(journal.data(), 1, journal.size(), f) == journal.size() );
+        fclose(f);
+    }
+    assert( store.open(dataFile, journalFile) && store.undoVersion() );
+    assert( sameData(storeContent(store), data) );
+    store.close();
+    remove(dataFile.c_str());
+    remove(journalFile.c_str());
+}
+
+void testVectored() {
+    uint8_t a[] = { 1, 2, 3 }, b[] = { 4 }, c[5000];
+    for (size_t i = 0; i < sizeof(c); i++) c[i] = i;
+    const iovec segments[] = { { a, sizeof(a) }, { b, 0 }, { c, sizeof(c) }, { b, sizeof(b) } };
+    CFile file, reference;
+    assert( writeTest(file, { 9, 9 }, 2) && writeTest(reference, { 9, 9 }, 2) );
+    assert( file.seek(1) && reference.seek(1) );
+    file.addVersion();
+    reference.addVersion();
+    assert( file.writev(segments, 4) == 5004 );
+    for (const iovec & segment : segments)
+        reference.write((const uint8_t *) segment.iov_base, segment.iov_len);
+    assert( sameData(content(file), content(reference)) );
+    assert( writeTest(file, { 7 }, 1) && writeTest(reference, { 7 }, 1) );
+    assert( sameData(content(file), content(reference)) );
+
+    uint8_t x[2], y[4000], z[3000];
+    const iovec targets[] = { { x, sizeof(x) }, { y, sizeof(y) }, { z, sizeof(z) } };
+    assert( file.seek(1) && file.readv(targets, 3) == 5005 );
+    assert( x[0] == 1 && x[1] == 2 && y[0] == 3 && y[1] == 0 && memcmp(z, c + 3999, 1001) == 0 );
+    assert( z[1001] == 4 && z[1002] == 7 && file.readv(targets, 3) == 0 );
+    assert( file.undoVersion() );
+    assert( file.seek(0) && readTest(file, { 9, 9 }, 10) );
+}
+
 int main(void) {
+    testVectorSpans();
+    testVectorStorage();
+    testIntervalSet();
+    testPages();
+    testVersionsRandom();
+    testHistory();
+    testSharedPointer();
+    testThreads();
+    testPersistent();
+    testCorruptedJournal();
+    testVectored();
+
     CFile f0;
 
     assert( writeTest(f0, { 10, 20, 30 }, 3));
@@ -607,6 +2300,14 @@ int main(void) {
     assert( !f1.undoVersion ());
 
     cout << "All tests padded!" << endl;
+#ifdef BENCHMARK
+    benchmarkCopyOnWrite();
+    benchmarkVersions();
+    benchmarkEditing();
+    benchmarkPersistent();
+    benchmarkVectored();
+    benchmarkVector();
+#endif /* BENCHMARK */
     return EXIT_SUCCESS;
 }
 #endif /* __PROGTEST__ */
@@ -17,6 +17,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <memory>
+#include <thread>
 using namespace std;
 #endif /* __PROGTEST__ */
 
@@ -49,6 +50,9 @@ class CDate {
          * @param o other date
          * @return it dates are not the same */
         inline bool operator!=(const CDate & o) const;
+        /** Counts days from a fixed day in the past
+         * @return number of the day, following days have following numbers */
+        int toDays() const;
         /** Prints date in [yyyy-mm-dd] format
          * @param out stream to print to
          * @param date date to print
@@ -63,17 +67,13 @@ struct NameCount {
     int count;
     NameCount(string n, int c): name(move(n)), count(c) {}
 };
-/** Holds all the item info - name, date and count */
+/** Refers to the first item of a product stored in the main map - product id,
+ * date and count, the count points into the map, so it can be changed in place */
 struct StoreItem {
-    string name;
+    uint32_t id;
     CDate date;
-    int count;
-    StoreItem(string n, const CDate & d, int c): name(move(n)), date(d), count(c) {}
-    /** Print item in (name, date, count) format
-     * @param out stream to print to
-     * @param item item to print
-     * @return the same out stream as passed in out param */
-    friend ostream & operator<<(ostream & out, const StoreItem & item);
+    int * count;
+    StoreItem(uint32_t i, const CDate & d, int * c): id(i), date(d), count(c) {}
 };
 
 namespace cmp {
@@ -84,9 +84,10 @@ namespace cmp {
     };
     /** Compares two items according this rules
      * date1  > date2
-     * name1  > name2
-     * count1 < count2
-     * It's ised is set sorting in expired method
+     * id1    < id2
+     * count is not a part of the key, it may change in place
+     * It's ised is set sorting in expired method to find products expiring
+     * before a date
      * @return true if all the rules are mached */
     struct DateComplexCmpInv {
         bool operator()(const StoreItem & i1, const StoreItem & i2) const;
@@ -103,33 +104,144 @@ namespace cmp {
 
 // shortcuts for CSupermarket
 typedef map<CDate, int, cmp::DateCmp> DateCountMap;
-typedef unordered_map<string, DateCountMap> MainMap;
+// indexed by product id, deque keeps the maps in place when growing
+typedef deque<DateCountMap> MainMap;
 typedef list<pair<string,int>> ProdList;
 
-namespace cmp {
-    /** Compares two MainMap iterators
-     * uses string < operator under the hood */
-    struct MainMapItrCmp {
-        int operator()(const MainMap::iterator & itr1, const MainMap::iterator & itr2) const; 
+/** Flat open addressing table of 64-bit key hashes and product ids
+ * the same hash may be stored more times, with different ids */
+class KeyIndex {
+    struct Slot {
+        uint64_t hash;
+        uint32_t id;
     };
-    /** Computes the hash code for a MainMap iterator
-     * uses string hash functor under the hood */
-    struct MainMapItrHash {
-        int operator()(const MainMap::iterator & itr) const;
-    };
-}
+    static const uint32_t EMPTY = UINT32_MAX;
+    vector<Slot> mSlots;
+    size_t mCount;
+    public:
+    KeyIndex();
+    KeyIndex(const KeyIndex & o) = default;
+    /** Takes the pairs, the source is left empty and usable
+     * @param o index to take the pairs from */
+    KeyIndex(KeyIndex && o);
+    KeyIndex & operator=(const KeyIndex & o) = default;
+    /** Takes the pairs, the source is left empty and usable
+     * @param o index to take the pairs from
+     * @return reference to this */
+    KeyIndex & operator=(KeyIndex && o);
+    /** Adds a hash - id pair
+     * @param hash hash of the key
+     * @param id product id */
+    void insert(uint64_t hash, uint32_t id);
+    /** Removes a pair added earlier, does nothing if it does not exist
+     * @param hash hash of the key
+     * @param id product id */
+    void remove(uint64_t hash, uint32_t id);
+    /** Calls callback for every id stored with the hash given
+     * @param hash hash of the key
+     * @param callback called with uint32_t id, returns false to stop */
+    template<typename F>
+    void forEach(uint64_t hash, F callback) const;
+    /** Calls callback for every hash - id pair stored
+     * @param callback called with uint64_t hash and uint32_t id */
+    template<typename F>
+    void forAll(F callback) const;
+    /** Spreads bits of a hash, so the low ones can index the table
+     * @param hash value to mix
+     * @return mixed value */
+    static uint64_t mix(uint64_t hash);
+    private:
+    /** Changes number of the slots and inserts all the pairs again
+     * @param capacity new slot count, power of 2 */
+    void rehash(size_t capacity);
+};
+
+/** Assigns dense ids to product names, the only place the names are stored
+ * ids of released names are given to the names added later */
+class NameTable {
+    vector<string> mNames;
+    // hashes of the names to their ids
+    KeyIndex mIds;
+    // released ids, the last one is reused first
+    vector<uint32_t> mFree;
+    public:
+    static const uint32_t NO_ID = UINT32_MAX;
+    /** Finds id of the name, adds the name if it is not there yet
+     * @param name product name
+     * @return id of the name */
+    uint32_t intern(const string & name);
+    /** Forgets the name of an id, so the id can be reused
+     * @param id id returned by intern() and not released yet */
+    void release(uint32_t id);
+    /** Finds id of the name
+     * @param name product name
+     * @return id of the name or NO_ID if it was never added */
+    uint32_t find(const string & name) const;
+    /** @param id id returned by intern()
+     * @return name of the id */
+    const string & operator[](uint32_t id) const;
+    /** @return number of ids used, released ones included */
+    size_t size() const;
+    private:
+    /** Computes the hash of a name used in mIds
+     * @param name product name
+     * @return hash of the name */
+    static uint64_t hash(const string & name);
+};
+
+/** Stock of a product by expiry day, Fenwick tree of counts of the days
+ * stocked, so the size does not depend on how far apart the days are */
+class DayTotals {
+    // sorted days and the tree of their counts
+    vector<int> mDays, mTree;
+    public:
+    DayTotals();
+    /** Changes the count of a day in O(log days), a day not stored yet
+     * costs O(days) unless it is later than all the others
+     * @param day number of the day, see CDate::toDays()
+     * @param count count to add, may be negative */
+    void add(int day, int count);
+    /** Sums counts of days before the day given in O(log days)
+     * @param day number of the day, see CDate::toDays()
+     * @return the sum */
+    int before(int day) const;
+    /** @return number of days stored */
+    size_t size() const;
+    private:
+    /** Sums counts of the first days stored
+     * @param n number of the days to sum
+     * @return the sum */
+    int prefix(size_t n) const;
+    /** Adds a day not stored yet and drops days with no stock
+     * @param pos index of the day in mDays
+     * @param day number of the day
+     * @param count count of the day */
+    void insert(size_t pos, int day, int count);
+};
 
 /** Manages all the storage management */
 class CSupermarket {
+    // product names and ids used by all the other members
+    NameTable mNames;
     // stores item in the way optimal for sell() method
     MainMap mMap;
-    // holds modified keys
-    unordered_multimap<string, shared_ptr<string>> mKeys;
-    // stores item in the way optimal for expired() method
+    // holds hashes of modified keys of products in stock
+    KeyIndex mKeys;
+    // stock of products by day, indexed by product id
+    vector<DayTotals> mTotals;
+    // first items of products in stock, finds products for expired() method
     set<StoreItem, cmp::DateComplexCmpInv> mSet;
     public:
     /** Creates an empty instasce of storage */
     CSupermarket();
+    /** Copies the storage, the expiry index is rebuilt for the new map
+     * @param o storage to copy */
+    CSupermarket(const CSupermarket & o);
+    CSupermarket(CSupermarket && o) = default;
+    /** Assigns a copy of or moves the storage given
+     * @param o storage to take content from
+     * @return reference to this */
+    CSupermarket & operator=(CSupermarket o);
     ~CSupermarket();
     /** Stores an item in the supermarket storage
      * @param name name of the item
@@ -139,11 +251,12 @@ class CSupermarket {
     CSupermarket & store(string name, const CDate & expiryDate, int count);
 
     private:
-    /** Replacement for pair<ProdList::iterator, MainMap::iterator>
-     * used in sell() method implementation */
+    /** Replacement for pair<ProdList::iterator, uint32_t>
+     * used in sell() method implementation, id is NameTable::NO_ID
+     * for items not found */
     struct AdvancedItem {
         ProdList::iterator listItr;
-        MainMap::iterator mapItr;
+        uint32_t id;
     };
 
     public:
@@ -151,22 +264,47 @@ class CSupermarket {
      * @param shoppingList list of items to sell
      * @return reference to this to enable chaining */
     CSupermarket & sell(ProdList & shoppingList);
+#ifndef __PROGTEST__
+    /** Sells items of more lists, the same as sell() called for each of them
+     * in order. The names are found by more threads at once first.
+     * @param shoppingLists lists of items to sell
+     * @return reference to this to enable chaining */
+    CSupermarket & sellBatch(vector<ProdList> & shoppingLists);
+    /** The same as sellBatch() above with the number of threads given
+     * @param shoppingLists lists of items to sell
+     * @param threadCount number of threads finding the names, 1 or less
+     *        finds them in the calling thread
+     * @return reference to this to enable chaining */
+    CSupermarket & sellBatch(vector<ProdList> & shoppingLists, size_t threadCount);
+#endif /* __PROGTEST__ */
     private:
+    /** Finds products for all the items of a list, does not change anything
+     * @param shoppingList list of items to sell
+     * @param items output, the items with product ids */
+    void resolve(ProdList & shoppingList, vector<AdvancedItem> & items) const;
+    /** Sells items found by resolve() and removes sold ones from the list
+     * @param shoppingList list of items to sell
+     * @param items the items with product ids
+     * @param recheck whether products may have been sold out since resolve(),
+     *        items not found or sold out are searched for again then
+     * @return true if some product has been sold out */
+    bool commit(ProdList & shoppingList, vector<AdvancedItem> & items, bool recheck);
     /** Tries to remove items from storage
-     * @param mapItr place to take items from
+     * @param id product to take items from
      * @param count how many items at most can be taken
      * @return the number of items left/not taken from storage */
-    inline int doBusiness(MainMap::iterator & mapItr, int count);
-    /** Removes empty maps from MainMap
-     * @param list of changed maps that can be not empty */
-    inline void cleanUpMap(list<AdvancedItem> & data);
-    /** Find item in MainMap with exact name match or
+    inline int doBusiness(uint32_t id, int count);
+    /** Removes keys of products sold out and releases their ids
+     * @param list of changed products, may contain a product more times
+     * @return true if some product has been sold out */
+    inline bool cleanUpMap(vector<AdvancedItem> & data);
+    /** Find product in stock with exact name match or
      * one with one letter changed (there cannot be more like this one)
      * @param name name to search for
-     * @param mapOut iterator to the place found, may be changed even if
+     * @param idOut id of the product found, may be changed even if
      *        the method returns false
      * @return true if an item was found, false otherwise */
-    inline bool findItem(const string & name, MainMap::iterator & mapOut);
+    inline bool findItem(const string & name, uint32_t & idOut) const;
     /** Checks if two names are the same except one character
      * Not used anymore, left for nostalgia reasons
      * @param str1 first string to compare
@@ -174,40 +312,39 @@ class CSupermarket {
      * @return true if the strings match */
     inline bool nameMatch(const string & str1, const string & str2) const;
 
-    /** Insert an item to mSet. If the item already exists, the count is added
-     * @param name the name of the item
+    /** Insert the first item of a product in the main map to mSet
+     * stock changes later are visible through the count pointer
+     * @param id the product id of the item, the index in mMap
      * @param date the date of item expiration
-     * @param count the amounth of the item added to the storage */
-    void insertOrUpdateToSet(const string & name, const CDate & date, int count);
-    /** Find item in set and replaces its count field
-     * Item with same name and date must exist int the set
-     * If count is 0, item is removed from the set
-     * @param name the name of the item
-     * @param date the expiration date of the item
-     * @param count the number of the item remaining in the storage */
-    void updateInSet(const string & name, const CDate & date, int count);
+     * @param count the count in the DateCountMap of the item */
+    void insertToSet(uint32_t id, const CDate & date, int & count);
+    /** Removes item from the set, must be called before it is erased from mMap
+     * @param id the product id of the item
+     * @param date the expiration date of the item */
+    void removeFromSet(uint32_t id, const CDate & date);
 
     /** Inserts keys parts into separate index for fast spell error correction
      * uses mKey map
      * cannot be called for already inserted item, otherwise diplicities may ocure!
-     * @param name name of newly added item */
-    void insertMapKeys(const string & name);
-    /** Removes keys inserted earlier by insertMapKeys() method for the same name
-     * called when the last item of the name was removed
-     * @param name name of newly added item */
-    void removeMapKeys(const string & name);
+     * @param id id of product just put in stock */
+    void insertMapKeys(uint32_t id);
+    /** Removes keys inserted earlier by insertMapKeys() method for the same id
+     * called when the last item of the product was removed
+     * @param id id of product sold out */
+    void removeMapKeys(uint32_t id);
     /** Tries to match searched name against keys already stored
      * @param search name to search for
-     * @param out real product name, used as optional output. May be changed
-     *        even if the method returs false!
-     * @return true if only one exact match occured, false otherwise */
-    bool findInKeys(const string & search, string & out) const;
-    /** Creates list of keys used later above.
-     * the keys are the name with one character replaced by '\0'
-     * for ahoj this method returns {0hoj, a0oj, ah0j, aho0}
+     * @return id of the real product if only one exact match occured,
+     *         NameTable::NO_ID otherwise */
+    uint32_t findInKeys(const string & search) const;
+    /** Computes hashes of keys used above, in O(len) in total.
+     * the keys are the name with one character masked,
+     * for ahoj these are hashes of {_hoj, a_oj, ah_j, aho_}
      * @param name name to generate keys for
-     * @return list of keys for the name */
-    vector<string> createKeys(const string & name) const;
+     * @param callback called with size_t position and uint64_t hash
+     *        of every key, returns false to stop */
+    template<typename F>
+    static void forEachKey(const string & name, F callback);
 
     public:
     /** Create a list of items that would be expired on a date given
@@ -256,16 +393,20 @@ bool CDate::operator==(const CDate & o) const {
 bool CDate::operator!=(const CDate & o) const {
     return !(*this == o);
 }
+int CDate::toDays() const {
+    // days from 0000-03-01, years start in march, so the leap day is the last
+    const int y = mY - (mM <= 2);
+    const int era = (y >= 0 ? y : y - 399) / 400;
+    const int yearOfEra = y - era * 400;
+    const int dayOfYear = (153 * (mM > 2 ? mM - 3 : mM + 9) + 2) / 5 + mD - 1;
+    const int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra;
+}
 ostream & operator<<(ostream & out, const CDate & date) {
     out << '[' << date.mY << '-' << (int)date.mM << '-' << (int)date.mD << ']';
     return out;
 }
 
-ostream & operator<<(ostream & out, const StoreItem & item) {
-    out << '(' << item.name << ", " << item.date << ", " << item.count << ')';
-    return out;
-}
-
 bool cmp::DateCmp::operator()(const CDate & i1, const CDate & i2) const {
     return i1 < i2;
 }
@@ -273,11 +414,7 @@ bool cmp::DateComplexCmpInv::operator()(const StoreItem & i1, const StoreItem &
     if (i1.date > i2.date) return true;
     if (i1.date < i2.date) return false;
     // other for equals and lower_bound
-    if (i1.name > i2.name) return true;
-    if (i1.name < i2.name) return false;
-    if (i1.count < i2.count) return true;
-    if (i1.count > i2.count) return false;
-    return false;
+    return i1.id < i2.id;
 }
 bool cmp::CountCmpInv::operator()(const NameCount & i1, const NameCount & i2) const {
     if (i1.count > i2.count) return true;
@@ -286,49 +423,72 @@ bool cmp::CountCmpInv::operator()(const NameCount & i1, const NameCount & i2) co
     if (i1.name < i2.name) return false;
     return false;
 }
-int cmp::MainMapItrCmp::operator()(const MainMap::iterator & itr1, const MainMap::iterator & itr2) const {
-    return itr1 -> first < itr2 -> first;
+CSupermarket::CSupermarket() {}
+CSupermarket::CSupermarket(const CSupermarket & o)
+        : mNames(o.mNames), mMap(o.mMap), mKeys(o.mKeys), mTotals(o.mTotals) {
+    for (uint32_t id = 0; id < mMap.size(); id++)
+        if (!mMap[id].empty())
+            insertToSet(id, mMap[id].begin() -> first, mMap[id].begin() -> second);
 }
-int cmp::MainMapItrHash::operator()(const MainMap::iterator & itr) const {
-    return std::hash<string>()(itr -> first);
+CSupermarket & CSupermarket::operator=(CSupermarket o) {
+    // swap keeps the map nodes, so the set still points to the right ones
+    swap(mNames, o.mNames);
+    swap(mMap, o.mMap);
+    swap(mKeys, o.mKeys);
+    swap(mTotals, o.mTotals);
+    swap(mSet, o.mSet);
+    return *this;
 }
-
-CSupermarket::CSupermarket() {}
 CSupermarket::~CSupermarket() {}
 CSupermarket & CSupermarket::store(string name, const CDate & expiryDate, int count) {
-    auto mapItr = mMap.find(name);
-    if (mapItr == mMap.end()) {
-        DateCountMap subMap;
-        subMap.insert(make_pair(expiryDate, count));
-        mMap.insert(make_pair(name, subMap));
-        insertMapKeys(name);
-    } else {
-        DateCountMap & subMap = mapItr -> second;
-        auto subItr = subMap.find(expiryDate);
-        if (subItr == subMap.end()) {
-            subMap.insert(make_pair(expiryDate, count));
-        } else {
-            // same date item already exists
-            subItr -> second += count;
+    const uint32_t id = mNames.intern(name);
+    if (id == mMap.size()) {
+        mMap.emplace_back();
+        mTotals.emplace_back();
+    }
+    DateCountMap & subMap = mMap[id];
+    if (subMap.empty()) insertMapKeys(id);
+    mTotals[id].add(expiryDate.toDays(), count);
+    auto subItr = subMap.find(expiryDate);
+    if (subItr == subMap.end()) {
+        subItr = subMap.emplace(expiryDate, count).first;
+        if (subItr == subMap.begin()) {
+            // new first item of the product
+            if (subMap.size() > 1) removeFromSet(id, next(subItr) -> first);
+            insertToSet(id, expiryDate, subItr -> second);
         }
+    } else {
+        // same date item already exists, the set sees the new count
+        subItr -> second += count;
     }
-
-    insertOrUpdateToSet(name, expiryDate, count);
     return *this;
 }
 
 CSupermarket & CSupermarket::sell(ProdList & shoppingList) {
-    list<AdvancedItem> iterators;
+    vector<AdvancedItem> items;
+    resolve(shoppingList, items);
+    commit(shoppingList, items, false);
+    return *this;
+}
+void CSupermarket::resolve(ProdList & shoppingList, vector<AdvancedItem> & items) const {
     // find sellable items
     for (auto itr = shoppingList.begin(); itr != shoppingList.end(); itr++) {
-        MainMap::iterator dataItr;
-        if (findItem(itr -> first, dataItr))
-            iterators.push_back({itr, dataItr});
+        uint32_t id;
+        if (!findItem(itr -> first, id)) id = NameTable::NO_ID;
+        items.push_back({itr, id});
     }
+}
+bool CSupermarket::commit(ProdList & shoppingList, vector<AdvancedItem> & items, bool recheck) {
+    // all items are found before any is sold, as in one sell() call
+    if (recheck)
+        for (auto & [listItr, id] : items)
+            if ((id == NameTable::NO_ID || mMap[id].empty()) && !findItem(listItr -> first, id))
+                id = NameTable::NO_ID;
     // sell items
-    for (auto & [listItr, mapItr] : iterators)
-        listItr -> second = doBusiness(mapItr, listItr -> second);
-    cleanUpMap(iterators);
+    for (auto & [listItr, id] : items)
+        if (id != NameTable::NO_ID)
+            listItr -> second = doBusiness(id, listItr -> second);
+    const bool soldOut = cleanUpMap(items);
 
     // drop sold items in the beginning
     while (shoppingList.size() != 0 && shoppingList.begin() -> second == 0)
@@ -345,52 +505,50 @@ CSupermarket & CSupermarket::sell(ProdList & shoppingList) {
             itr++;
         }
     }
-    return *this;
+    return soldOut;
 }
-inline int CSupermarket::doBusiness(MainMap::iterator & mapItr, int count) {
-    const string& realName = mapItr -> first;
-    DateCountMap& data = mapItr -> second;
-    // empty item - date pairs
-    vector<CDate> toRemove;
-    for (auto &[key, value] : data) {
-        if (count == 0) break;
-        if (value > count) {
-            value -= count;
-            count = 0;
-            updateInSet(realName, key, value);
-            break;
-        } else {
-            count -= value;
-            toRemove.push_back(key);
-        }
+inline int CSupermarket::doBusiness(uint32_t id, int count) {
+    DateCountMap& data = mMap[id];
+    // the product may be sold out by the same list already
+    if (data.empty()) return count;
+    const CDate first = data.begin() -> first;
+    // items expiring first are sold first
+    while (count != 0 && !data.empty()) {
+        const auto itr = data.begin();
+        const int sold = min(count, itr -> second);
+        itr -> second -= sold;
+        count -= sold;
+        mTotals[id].add(itr -> first.toDays(), -sold);
+        if (itr -> second == 0) data.erase(itr);
     }
-    for (const auto & key : toRemove) {
-        data.erase(key);
-        updateInSet(realName, key, 0);
+    if (data.empty()) {
+        removeFromSet(id, first);
+        // no days are kept for a product out of stock
+        mTotals[id] = DayTotals();
+    } else if (data.begin() -> first != first) {
+        removeFromSet(id, first);
+        insertToSet(id, data.begin() -> first, data.begin() -> second);
     }
     return count;
 }
-inline void CSupermarket::cleanUpMap(list<AdvancedItem> & data) {
-    unordered_set<MainMap::iterator, cmp::MainMapItrHash> iterators;
-    for (auto & [listItr, mapItr] : data)
-        iterators.insert(mapItr);
-    for (MainMap::iterator mapItr : iterators)
-        if (mapItr -> second.empty()) {
-            removeMapKeys(mapItr -> first);
-            mMap.erase(mapItr);
+inline bool CSupermarket::cleanUpMap(vector<AdvancedItem> & data) {
+    bool soldOut = false;
+    for (auto & [listItr, id] : data)
+        if (id != NameTable::NO_ID && mMap[id].empty()) {
+            // the list may hold the product more times, it is released once
+            if (mNames.find(mNames[id]) == id) {
+                removeMapKeys(id);
+                mNames.release(id);
+            }
+            soldOut = true;
         }
+    return soldOut;
 }
-inline bool CSupermarket::findItem(const string & name, MainMap::iterator & mapOut) {
-    const auto mapItr = mMap.find(name);
-    if (mapItr != mMap.end()) {
-        mapOut = mapItr;
-    } else {
-        string realName;
-        if (!findInKeys(name, realName)) return false;
-        // key must exists
-        mapOut = mMap.find(realName);
-    }
-    return true;
+inline bool CSupermarket::findItem(const string & name, uint32_t & idOut) const {
+    idOut = mNames.find(name);
+    if (idOut != NameTable::NO_ID && !mMap[idOut].empty()) return true;
+    idOut = findInKeys(name);
+    return idOut != NameTable::NO_ID;
 }
 inline bool CSupermarket::nameMatch(const string & str1, const string & str2) const {
     const size_t len = str1.length();
@@ -404,114 +562,287 @@ inline bool CSupermarket::nameMatch(const string & str1, const string & str2) co
     }
     return true;
 }
-void CSupermarket::insertOrUpdateToSet(const string & name, const CDate & date, int count) {
-    auto setItr = mSet.lower_bound(StoreItem(name, date, 0));
-    if (setItr != mSet.end() && setItr -> name == name && setItr -> date == date) {
-        StoreItem item = *setItr;
-        item.count += count;
-        mSet.erase(setItr);
-        mSet.insert(item);
+void CSupermarket::insertToSet(uint32_t id, const CDate & date, int & count) {
+    mSet.insert(StoreItem(id, date, &count));
+}
+void CSupermarket::removeFromSet(uint32_t id, const CDate & date) {
+    mSet.erase(StoreItem(id, date, nullptr));
+}
+void CSupermarket::insertMapKeys(uint32_t id) {
+    forEachKey(mNames[id], [&](size_t, uint64_t hash) {
+        mKeys.insert(hash, id);
+        return true;
+    });
+}
+void CSupermarket::removeMapKeys(uint32_t id) {
+    forEachKey(mNames[id], [&](size_t, uint64_t hash) {
+        mKeys.remove(hash, id);
+        return true;
+    });
+}
+uint32_t CSupermarket::findInKeys(const string & search) const {
+    uint32_t out = NameTable::NO_ID;
+    bool anyFound = false, ambiguous = false;
+    forEachKey(search, [&](size_t pos, uint64_t hash) {
+        size_t matches = 0;
+        mKeys.forEach(hash, [&](uint32_t id) {
+            // hashes may collide, check the name really matches the key
+            const string & name = mNames[id];
+            if (name.length() != search.length()
+                    || name.compare(0, pos, search, 0, pos) != 0
+                    || name.compare(pos + 1, string::npos, search, pos + 1, string::npos) != 0)
+                return true;
+            out = id;
+            return ++matches < 2;
+        });
+        if (matches > 1 || (matches == 1 && anyFound)) ambiguous = true;
+        if (matches == 1) anyFound = true;
+        return !ambiguous;
+    });
+    return anyFound && !ambiguous ? out : NameTable::NO_ID;
+}
+template<typename F>
+void CSupermarket::forEachKey(const string & name, F callback) {
+    // polynomial hash, masked character counts as 0, others as 1 - 256
+    const uint64_t base = 0x100000001b3ULL;
+    uint64_t whole = 0;
+    for (const char c : name)
+        whole = whole * base + (uint8_t) c + 1;
+    uint64_t power = 1;
+    for (size_t i = name.length(); i-- > 0; power *= base) {
+        const uint64_t hash = whole - power * ((uint8_t) name[i] + 1) + name.length();
+        if (!callback(i, KeyIndex::mix(hash))) return;
+    }
+}
+
+KeyIndex::KeyIndex(): mSlots(16, Slot{0, EMPTY}), mCount(0) {}
+KeyIndex::KeyIndex(KeyIndex && o): mSlots(move(o.mSlots)), mCount(o.mCount) {
+    // probing needs a power of 2 of slots, an empty vector has none
+    o.mSlots.assign(16, Slot{0, EMPTY});
+    o.mCount = 0;
+}
+KeyIndex & KeyIndex::operator=(KeyIndex && o) {
+    if (this == &o) return *this;
+    mSlots = move(o.mSlots);
+    mCount = o.mCount;
+    o.mSlots.assign(16, Slot{0, EMPTY});
+    o.mCount = 0;
+    return *this;
+}
+void KeyIndex::insert(uint64_t hash, uint32_t id) {
+    if (2 * (mCount + 1) > mSlots.size()) rehash(2 * mSlots.size());
+    const size_t mask = mSlots.size() - 1;
+    size_t i = hash & mask;
+    while (mSlots[i].id != EMPTY) i = (i + 1) & mask;
+    mSlots[i] = Slot{hash, id};
+    mCount++;
+}
+void KeyIndex::remove(uint64_t hash, uint32_t id) {
+    const size_t mask = mSlots.size() - 1;
+    size_t i = hash & mask;
+    while (mSlots[i].id != EMPTY && (mSlots[i].hash != hash || mSlots[i].id != id))
+        i = (i + 1) & mask;
+    if (mSlots[i].id == EMPTY) return;
+    // shift following slots back, so no lookup chain is broken
+    for (size_t j = (i + 1) & mask; mSlots[j].id != EMPTY; j = (j + 1) & mask) {
+        const size_t home = mSlots[j].hash & mask;
+        // slot j can be moved to i only if its home is not in (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            mSlots[i] = mSlots[j];
+            i = j;
+        }
+    }
+    mSlots[i].id = EMPTY;
+    mCount--;
+}
+template<typename F>
+void KeyIndex::forEach(uint64_t hash, F callback) const {
+    const size_t mask = mSlots.size() - 1;
+    for (size_t i = hash & mask; mSlots[i].id != EMPTY; i = (i + 1) & mask)
+        if (mSlots[i].hash == hash && !callback(mSlots[i].id)) return;
+}
+template<typename F>
+void KeyIndex::forAll(F callback) const {
+    for (const Slot & slot : mSlots)
+        if (slot.id != EMPTY) callback(slot.hash, slot.id);
+}
+uint64_t KeyIndex::mix(uint64_t hash) {
+    // final mix of splitmix64
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+void KeyIndex::rehash(size_t capacity) {
+    vector<Slot> old(capacity, Slot{0, EMPTY});
+    old.swap(mSlots);
+    mCount = 0;
+    for (const Slot & slot : old)
+        if (slot.id != EMPTY) insert(slot.hash, slot.id);
+}
+
+uint32_t NameTable::intern(const string & name) {
+    uint32_t id = find(name);
+    if (id != NO_ID) return id;
+    if (mFree.empty()) {
+        id = mNames.size();
+        mNames.push_back(name);
     } else {
-        mSet.insert(StoreItem(name, date, count));
+        id = mFree.back();
+        mFree.pop_back();
+        mNames[id] = name;
+    }
+    mIds.insert(hash(name), id);
+    return id;
+}
+void NameTable::release(uint32_t id) {
+    mIds.remove(hash(mNames[id]), id);
+    string().swap(mNames[id]);
+    mFree.push_back(id);
+}
+uint32_t NameTable::find(const string & name) const {
+    uint32_t found = NO_ID;
+    mIds.forEach(hash(name), [&](uint32_t id) {
+        if (mNames[id] == name) found = id;
+        return found == NO_ID;
+    });
+    return found;
+}
+const string & NameTable::operator[](uint32_t id) const {
+    return mNames[id];
+}
+size_t NameTable::size() const {
+    return mNames.size();
+}
+uint64_t NameTable::hash(const string & name) {
+    uint64_t hash = name.length();
+    for (const char c : name)
+        hash = hash * 0x100000001b3ULL + (uint8_t) c;
+    return KeyIndex::mix(hash);
+}
+
+DayTotals::DayTotals() {}
+void DayTotals::add(int day, int count) {
+    const size_t pos = lower_bound(mDays.begin(), mDays.end(), day) - mDays.begin();
+    if (pos == mDays.size() || mDays[pos] != day) {
+        if (count == 0) return;
+        const size_t i = pos + 1;
+        // a later day gets a new node in O(log days), days with no stock
+        // are dropped by a rebuild once the size reaches a power of 2
+        if (pos == mDays.size() && (i & (i - 1)) != 0) {
+            mDays.push_back(day);
+            mTree.push_back(count + prefix(pos) - prefix(i - (i & -i)));
+        } else
+            insert(pos, day, count);
+        return;
     }
+    for (size_t i = pos + 1; i <= mTree.size(); i += i & -i)
+        mTree[i - 1] += count;
+}
+int DayTotals::before(int day) const {
+    return prefix(lower_bound(mDays.begin(), mDays.end(), day) - mDays.begin());
+}
+int DayTotals::prefix(size_t n) const {
+    int sum = 0;
+    for (size_t i = n; i > 0; i -= i & -i)
+        sum += mTree[i - 1];
+    return sum;
 }
-void CSupermarket::updateInSet(const string & name, const CDate & date, int count) {
-    auto setItr = mSet.lower_bound(StoreItem(name, date, 0));
-    StoreItem item = *setItr;
-    if (count != 0) {
-        item.count = count;
-        mSet.insert(item);
+size_t DayTotals::size() const {
+    return mDays.size();
+}
+void DayTotals::insert(size_t pos, int day, int count) {
+    // counts of single days, the tree is built back in place in O(days)
+    for (size_t i = mTree.size(); i > 0; i--) {
+        const size_t parent = i + (i & -i);
+        if (parent <= mTree.size()) mTree[parent - 1] -= mTree[i - 1];
     }
-    mSet.erase(setItr);
-}
-void CSupermarket::insertMapKeys(const string & name) {
-    shared_ptr<string> copy = shared_ptr<string>(new string(name));
-    vector<string> keys = createKeys(name);
-    for (string & key : keys)
-        mKeys.emplace(move(key), copy);
-}
-void CSupermarket::removeMapKeys(const string & name) {
-    vector<string> keys = createKeys(name);
-    for (const string & key : keys) {
-        auto range = mKeys.equal_range(key);
-        for (auto it = range.first; it != range.second; ++it) {
-            if (*(it -> second) == name) {
-                mKeys.erase(it);
-                break;
-            }
+    mDays.insert(mDays.begin() + pos, day);
+    mTree.insert(mTree.begin() + pos, count);
+    size_t size = 0;
+    for (size_t i = 0; i < mDays.size(); i++)
+        if (mTree[i] != 0) {
+            mDays[size] = mDays[i];
+            mTree[size++] = mTree[i];
         }
+    mDays.resize(size);
+    mTree.resize(size);
+    for (size_t i = 1; i <= size; i++) {
+        const size_t parent = i + (i & -i);
+        if (parent <= size) mTree[parent - 1] += mTree[i - 1];
     }
 }
-bool CSupermarket::findInKeys(const string & search, string & out) const {
-    vector<string> keys = createKeys(search);
-    bool anyFound = false;
-    for (const string & key : keys) {
-        auto range = mKeys.equal_range(key);
-        auto distance = std::distance(range.first, range.second);
-        if (distance == 1) {
-            if (anyFound) return false; else anyFound = true;
-            out = *(range.first -> second);
-        } else if (distance > 1) return false;
-    }
-    return anyFound;
-}
-vector<string> CSupermarket::createKeys(const string & name) const {
-    vector<string> data;
-    for (size_t i = 0; i < name.length(); i++) {
-        string key = string(name);
-        key.at(i) = '\0';
-        data.emplace_back(move(key));
+
+#ifndef __PROGTEST__
+CSupermarket & CSupermarket::sellBatch(vector<ProdList> & shoppingLists) {
+    return sellBatch(shoppingLists, min<size_t>(max(1U, thread::hardware_concurrency()),
+                                                (shoppingLists.size() + 63) / 64));
+}
+CSupermarket & CSupermarket::sellBatch(vector<ProdList> & shoppingLists, size_t threadCount) {
+    vector<vector<AdvancedItem>> items(shoppingLists.size());
+    auto resolveEvery = [&](size_t first, size_t step) {
+        for (size_t i = first; i < shoppingLists.size(); i += step)
+            resolve(shoppingLists[i], items[i]);
+    };
+    if (threadCount <= 1)
+        resolveEvery(0, 1);
+    else {
+        // nothing changes while the names are found, so threads can share the indexes
+        vector<thread> threads;
+        try {
+            for (size_t t = 0; t < threadCount; t++)
+                threads.emplace_back(resolveEvery, t, threadCount);
+        } catch (...) {
+            // the threads started use the items, they must end first
+            for (thread & worker : threads) worker.join();
+            throw;
+        }
+        for (thread & worker : threads) worker.join();
     }
-    return data;
+    // sales only take products out of stock, products found still in stock
+    // are the ones sell() would find, the rest is searched for again
+    bool soldOut = false;
+    for (size_t i = 0; i < shoppingLists.size(); i++)
+        soldOut = commit(shoppingLists[i], items[i], soldOut) || soldOut;
+    return *this;
 }
+#endif /* __PROGTEST__ */
 
 ProdList CSupermarket::expired(const CDate & date) const {
-    unordered_map<string, int> expired;
-    set<NameCount, cmp::CountCmpInv> sorted;
+    const int day = date.toDays();
+    vector<NameCount> sorted;
     ProdList outList;
 
-    auto itr = mSet.lower_bound(StoreItem("", date, 0));
-    for (; itr != mSet.end(); ++itr) {
-        const StoreItem & item = *itr;
-        auto mapItr = expired.find(item.name);
-        if (mapItr == expired.end())
-            expired.insert(make_pair(item.name, item.count));
-        else
-            mapItr -> second += item.count;
-    }
+    // products with the first item before the date
+    auto itr = mSet.lower_bound(StoreItem(NameTable::NO_ID, date, nullptr));
+    for (; itr != mSet.end(); ++itr)
+        sorted.emplace_back(mNames[itr -> id], mTotals[itr -> id].before(day));
     // sort selected items by count
-    for (auto const & [name, count] : expired)
-        sorted.insert(NameCount(name, count));
-    for (const NameCount & item : sorted)
-        outList.emplace_back(make_pair(item.name, item.count));
+    sort(sorted.begin(), sorted.end(), cmp::CountCmpInv());
+    for (NameCount & item : sorted)
+        outList.emplace_back(move(item.name), item.count);
     return outList;
 }
 void CSupermarket::printMap(ostream & out) const {
     out << "Map" << endl;
-    for (const auto & [name, data] : mMap) {
-        out << "+ " << name << endl;
-        for (const auto & [date, count] : data) {
+    for (uint32_t id = 0; id < mMap.size(); id++) {
+        if (mMap[id].empty()) continue;
+        out << "+ " << mNames[id] << endl;
+        for (const auto & [date, count] : mMap[id]) {
             out << "> " << date << " - " << count << endl;
         }
     }
 }
 void CSupermarket::printKeys(ostream & out) const {
     out << "Keys" << endl;
-    for (auto itr = mKeys.begin(); itr != mKeys.end(); ) {
-        const auto curr = itr;
-        out << "* " << itr -> first << " - ";
-        while (itr != mKeys.end() && itr->first == curr->first) {
-            if (itr != curr) out << ", ";
-            out  << *(itr -> second);
-            ++itr;
-        }
-        out << endl;
-    }
+    mKeys.forAll([&](uint64_t hash, uint32_t id) {
+        out << "* " << hex << setw(16) << setfill('0') << hash << dec << setfill(' ')
+            << " - " << mNames[id] << endl;
+    });
 }
 void CSupermarket::printSet(ostream & out) const {
     out << "Set" << endl;
     for (const StoreItem & item : mSet) {
-        out << "/ " << item << endl;
+        out << "/ (" << mNames[item.id] << ", " << item.date << ", " << *item.count << ')' << endl;
     }
 }
 
@@ -596,8 +927,490 @@ void myTest() {
     assert((l == ProdList{{"Never", 1}, {"gonna", 1}, {"tell", 1}, {"a", 1}, {"lie", 1}, {"and", 1}, {"hurt", 1}, {"you", 1}}));
 }
 
+#ifdef BENCHMARK
+#include <chrono>
+#include <malloc.h>
+
+template <class F>
+double measureMs(F f) {
+    const auto start = chrono::steady_clock::now();
+    f();
+    const auto end = chrono::steady_clock::now();
+    return chrono::duration<double, milli>(end - start).count();
+}
+
+vector<string> benchmarkNames(size_t count) {
+    vector<string> names;
+    for (size_t i = 0; i < count; i++)
+        names.push_back("product-" + to_string(i * 7919 % 1000003));
+    return names;
+}
+
+void benchmarkStock() {
+    const size_t products = 20000, days = 20;
+    const vector<string> names = benchmarkNames(products);
+    CSupermarket s;
+    const double tStore = measureMs([&]() {
+        for (size_t d = 0; d < days; d++)
+            for (const string & name : names)
+                s.store(name, CDate(2022, 1 + d / 28, 1 + d % 28), 10);
+    });
+    const double tRestock = measureMs([&]() {
+        for (size_t d = 0; d < days; d++)
+            for (const string & name : names)
+                s.store(name, CDate(2022, 1 + d / 28, 1 + d % 28), 10);
+    });
+    size_t left = 0;
+    const double tSell = measureMs([&]() {
+        for (size_t round = 0; round < 2 * days; round++)
+            for (size_t i = 0; i < products; i += 10) {
+                ProdList list;
+                for (size_t j = i; j < i + 10; j++) list.emplace_back(names[j], 7);
+                s.sell(list);
+                left += list.size();
+            }
+    });
+    assert( left == 0 );
+
+    cout << "BENCH: " << products << " products, " << days << " dates each" << endl;
+    cout << "  store new      " << tStore << " ms" << endl;
+    cout << "  store existing " << tRestock << " ms" << endl;
+    cout << "  sell           " << tSell << " ms" << endl;
+}
+
+void benchmarkFuzzy() {
+    const size_t products = 20000, rounds = 10;
+    const vector<string> names = benchmarkNames(products);
+    CSupermarket s;
+    for (const string & name : names)
+        s.store(name, CDate(2022, 1, 1), rounds);
+    vector<string> typos;
+    for (size_t i = 0; i < products; i++) {
+        typos.push_back(names[i]);
+        typos.back()[i % 7] = 'X';
+    }
+    size_t left = 0;
+    const double tSell = measureMs([&]() {
+        for (size_t round = 0; round < rounds; round++)
+            for (size_t i = 0; i < products; i += 10) {
+                ProdList list;
+                for (size_t j = i; j < i + 10; j++) list.emplace_back(typos[j], 1);
+                s.sell(list);
+                left += list.size();
+            }
+    });
+    assert( left == 0 );
+
+    cout << "BENCH: " << products * rounds << " sells of misspelled names" << endl;
+    cout << "  sell           " << tSell << " ms" << endl;
+}
+
+void benchmarkExpired() {
+    const size_t products = 20000, days = 60, queries = 50;
+    const vector<string> names = benchmarkNames(products);
+    CSupermarket s;
+    for (size_t d = 0; d < days; d++)
+        for (size_t i = d % 3; i < products; i += 3)
+            s.store(names[i], CDate(2022, 1 + d / 28, 1 + d % 28), 1 + i % 100);
+    size_t total = 0;
+    const double tExpired = measureMs([&]() {
+        for (size_t q = 0; q < queries; q++) {
+            const size_t d = q * days / queries;
+            total += s.expired(CDate(2022, 1 + d / 28, 1 + d % 28)).size();
+        }
+    });
+    assert( total > 0 );
+
+    cout << "BENCH: " << queries << " expired() over " << products << " products, " << days << " dates" << endl;
+    cout << "  expired        " << tExpired << " ms" << endl;
+}
+
+/** Bytes allocated on the heap now */
+size_t heapBytes() {
+    return mallinfo2().uordblks;
+}
+
+void benchmarkChurn() {
+    const size_t products = 20000, rounds = 10;
+    CSupermarket s;
+    const size_t empty = heapBytes();
+    size_t first = 0, last = 0;
+    for (size_t round = 0; round < rounds; round++) {
+        // every round stocks products never seen before and sells them out
+        vector<string> names = benchmarkNames(products);
+        for (string & name : names) name += "-" + to_string(round);
+        for (const string & name : names)
+            s.store(name, CDate(2022, 1, 1 + round), 3);
+        (round == 0 ? first : last) = heapBytes() - empty;
+        for (size_t i = 0; i < products; i += 10) {
+            ProdList list;
+            for (size_t j = i; j < i + 10; j++) list.emplace_back(names[j], 3);
+            s.sell(list);
+            assert( list.empty() );
+        }
+    }
+
+    cout << "BENCH: " << rounds << " rounds of " << products << " new products sold out" << endl;
+    cout << "  heap round 1   " << first / products << " B/SKU" << endl;
+    cout << "  heap round " << rounds << "  " << last / products << " B/SKU" << endl;
+}
+
+void benchmarkBatch() {
+    const size_t products = 20000, lists = 20000;
+    const vector<string> names = benchmarkNames(products);
+    CSupermarket s;
+    for (const string & name : names)
+        s.store(name, CDate(2022, 1, 1), 10);
+    vector<ProdList> batch(lists);
+    for (size_t i = 0; i < lists; i++)
+        for (size_t j = 0; j < 10; j++) {
+            string name = names[(i * 10 + j) * 7 % products];
+            // every other item is misspelled
+            if (j % 2) name[j % 7] = 'X';
+            batch[i].emplace_back(name, 1);
+        }
+    CSupermarket sequential = s;
+    vector<ProdList> sequentialBatch = batch;
+    const double tSequential = measureMs([&]() {
+        for (ProdList & l : sequentialBatch) sequential.sell(l);
+    });
+    cout << "BENCH: " << lists << " lists of 10 items, " << thread::hardware_concurrency() << " cores" << endl;
+    cout << "  sell           " << tSequential << " ms" << endl;
+    for (const size_t threadCount : { 1, 2, 4, 8 }) {
+        CSupermarket shop = s;
+        vector<ProdList> threadBatch = batch;
+        const double tBatch = measureMs([&]() {
+            shop.sellBatch(threadBatch, threadCount);
+        });
+        assert( threadBatch == sequentialBatch );
+        cout << "  sellBatch x" << threadCount << "   " << tBatch << " ms" << endl;
+    }
+}
+#endif /* BENCHMARK */
+
+void testCopy() {
+    CSupermarket s;
+    s.store("milk", CDate(2022, 1, 1), 5)
+        .store("milk", CDate(2022, 1, 2), 5)
+        .store("eggs", CDate(2022, 1, 1), 3)
+        .store("milk", CDate(2022, 1, 1), 2);
+    assert((s.expired(CDate(2022, 1, 2)) == ProdList{{"milk", 7}, {"eggs", 3}}));
+
+    CSupermarket copy = s;
+    ProdList l = {{"milk", 8}, {"eggs", 1}};
+    copy.sell(l);
+    assert(l.empty());
+    assert((copy.expired(CDate(2022, 2, 1)) == ProdList{{"milk", 4}, {"eggs", 2}}));
+    assert((s.expired(CDate(2022, 2, 1)) == ProdList{{"milk", 12}, {"eggs", 3}}));
+
+    s = copy;
+    copy = CSupermarket();
+    s = s;
+    l = {{"milk", 4}};
+    s.sell(l);
+    assert(l.empty());
+    assert((s.expired(CDate(2022, 2, 1)) == ProdList{{"eggs", 2}}));
+    assert(copy.expired(CDate(2022, 2, 1)).empty());
+
+    // a moved-from storage is empty and can be used again
+    CSupermarket moved = move(s);
+    l = {{"eggs", 1}, {"egg", 1}};
+    s.sell(l);
+    assert((l == ProdList{{"eggs", 1}, {"egg", 1}}));
+    assert(s.expired(CDate(2022, 2, 1)).empty());
+    s.store("eggs", CDate(2022, 1, 1), 1);
+    l = {{"eggz", 1}};
+    s.sell(l);
+    assert(l.empty());
+    copy = move(moved);
+    l = {{"eggs", 1}};
+    moved.sell(l);
+    assert((l == ProdList{{"eggs", 1}}));
+    moved.store("milk", CDate(2022, 1, 1), 1);
+    assert((moved.expired(CDate(2022, 2, 1)) == ProdList{{"milk", 1}}));
+    assert((copy.expired(CDate(2022, 2, 1)) == ProdList{{"eggs", 2}}));
+}
+
+void testKeyIndex() {
+    KeyIndex index;
+    multiset<pair<uint64_t, uint32_t>> model;
+    srand(42);
+    for (int i = 0; i < 20000; i++) {
+        // few hashes with the same low bits make long chains
+        const uint64_t hash = ((uint64_t) (rand() % 50) << 40) | (rand() % 4);
+        const uint32_t id = rand() % 5;
+        if (rand() % 3) {
+            index.insert(hash, id);
+            model.emplace(hash, id);
+        } else {
+            index.remove(hash, id);
+            auto itr = model.find(make_pair(hash, id));
+            if (itr != model.end()) model.erase(itr);
+        }
+        if (i % 100 == 0) {
+            size_t count = 0;
+            index.forAll([&](uint64_t, uint32_t) { count++; });
+            assert( count == model.size() );
+            for (uint64_t h = 0; h < 4; h++) {
+                const uint64_t probe = (hash & ~3ULL) | h;
+                multiset<uint32_t> ids;
+                index.forEach(probe, [&](uint32_t found) {
+                    ids.insert(found);
+                    return true;
+                });
+                multiset<uint32_t> expected;
+                for (const auto & [stored, storedId] : model)
+                    if (stored == probe) expected.insert(storedId);
+                assert( ids == expected );
+            }
+        }
+    }
+}
+
+void testNameTable() {
+    NameTable names;
+    assert( names.find("milk") == NameTable::NO_ID && names.size() == 0 );
+    for (int i = 0; i < 1000; i++)
+        assert( names.intern(to_string(i)) == (uint32_t) i );
+    assert( names.intern("") == 1000 && names.find("") == 1000 );
+    for (int i = 999; i >= 0; i--) {
+        assert( names.intern(to_string(i)) == (uint32_t) i );
+        assert( names.find(to_string(i)) == (uint32_t) i && names[i] == to_string(i) );
+    }
+    assert( names.find("1000") == NameTable::NO_ID && names.size() == 1001 );
+    // released ids are reused, the names are not found any more
+    names.release(7);
+    names.release(500);
+    assert( names.find("7") == NameTable::NO_ID && names.find("500") == NameTable::NO_ID );
+    assert( names.intern("x") == 500 && names.intern("y") == 7 && names.intern("z") == 1001 );
+    assert( names.find("x") == 500 && names[7] == "y" && names.find("8") == 8 );
+
+    // sold out milk is not in stock, so it is a typo of silk
+    CSupermarket s;
+    s.store("milk", CDate(2022, 1, 1), 1).store("silk", CDate(2022, 1, 1), 1);
+    ProdList l = {{"milk", 1}};
+    s.sell(l);
+    assert( l.empty() );
+    l = {{"milk", 1}};
+    s.sell(l);
+    assert( l.empty() );
+    l = {{"milk", 1}};
+    s.sell(l);
+    assert((l == ProdList{{"milk", 1}}));
+    s.store("milk", CDate(2022, 1, 2), 1);
+    assert((s.expired(CDate(2022, 1, 3)) == ProdList{{"milk", 1}}));
+
+    // ids of sold out products are reused by new ones, a list with
+    // the product more times releases it once
+    s.store("tea", CDate(2022, 1, 1), 2);
+    l = {{"tea", 1}, {"tea", 1}, {"tea", 1}};
+    s.sell(l);
+    assert((l == ProdList{{"tea", 1}}));
+    s.store("rum", CDate(2022, 1, 5), 3).store("gin", CDate(2022, 1, 6), 4);
+    l = {{"tea", 1}, {"rUm", 1}, {"gon", 1}, {"milk", 1}};
+    s.sell(l);
+    assert((l == ProdList{{"tea", 1}}));
+    assert((s.expired(CDate(2022, 2, 1)) == ProdList{{"gin", 3}, {"rum", 2}}));
+    CSupermarket copy = s;
+    copy.store("tea", CDate(2022, 1, 1), 1);
+    assert((copy.expired(CDate(2022, 2, 1)) == ProdList{{"gin", 3}, {"rum", 2}, {"tea", 1}}));
+    assert((s.expired(CDate(2022, 2, 1)) == ProdList{{"gin", 3}, {"rum", 2}}));
+}
+
+void testDays() {
+    assert( CDate(2000, 3, 1).toDays() - CDate(2000, 2, 28).toDays() == 2 );
+    assert( CDate(1900, 3, 1).toDays() - CDate(1900, 2, 28).toDays() == 1 );
+    assert( CDate(2023, 1, 1).toDays() - CDate(2022, 12, 31).toDays() == 1 );
+    assert( CDate(2022, 1, 1).toDays() - CDate(2021, 1, 1).toDays() == 365 );
+    assert( CDate(2401, 1, 1).toDays() - CDate(2001, 1, 1).toDays() == 146097 );
+
+    DayTotals totals;
+    map<int, int> model;
+    srand(3);
+    for (int i = 0; i < 3000; i++) {
+        // the range grows to both sides
+        const int day = 1000 + (rand() % (20 + i / 3)) * (rand() % 2 ? 1 : -1);
+        const int count = rand() % 10 - 3;
+        totals.add(day, count);
+        model[day] += count;
+        if (i % 50 == 0)
+            for (int probe = 0; probe < 2100; probe += 7) {
+                int sum = 0;
+                for (auto itr = model.begin(); itr != model.end() && itr -> first < probe; ++itr)
+                    sum += itr -> second;
+                assert( totals.before(probe) == sum );
+            }
+    }
+
+    // later days are appended, the earliest ones are sold out meanwhile
+    DayTotals later;
+    map<int, int> stocked;
+    for (int day = 0; day < 3000; day++) {
+        const int count = 1 + rand() % 5;
+        later.add(day, count);
+        stocked[day] += count;
+        if (day % 3 == 0) {
+            later.add(stocked.begin() -> first, -stocked.begin() -> second);
+            stocked.erase(stocked.begin());
+        }
+        if (day % 97 == 0) {
+            int sum = 0;
+            for (const auto & [stockedDay, stockedCount] : stocked) {
+                assert( later.before(stockedDay) == sum );
+                sum += stockedCount;
+            }
+            assert( later.before(day + 1) == sum );
+        }
+    }
+    // the sold out days are dropped at the rebuilds
+    assert( later.size() < 2 * stocked.size() );
+
+    // days far apart take no more space than days next to each other
+    const CDate first(1900, 1, 1), middle(2500, 1, 1), last(65535, 12, 31);
+    DayTotals wide;
+    wide.add(last.toDays(), 4);
+    wide.add(first.toDays(), 1);
+    wide.add(middle.toDays(), 2);
+    wide.add(middle.toDays(), -2);
+    wide.add(last.toDays() - 1, 8);
+    // the sold out day is dropped when the next day is added
+    assert( wide.size() == 3 );
+    assert( wide.before(first.toDays()) == 0 && wide.before(middle.toDays() + 1) == 1 );
+    assert( wide.before(last.toDays()) == 9 && wide.before(last.toDays() + 1) == 13 );
+    CSupermarket s;
+    s.store("tea", last, 4).store("tea", first, 1).store("tea", middle, 2);
+    assert((s.expired(CDate(1900, 1, 2)) == ProdList{{"tea", 1}}));
+    assert((s.expired(CDate(3000, 1, 1)) == ProdList{{"tea", 3}}));
+    assert((s.expired(CDate(65535, 12, 31)) == ProdList{{"tea", 3}}));
+    ProdList l = {{"tea", 2}};
+    s.sell(l);
+    assert( l.empty() && (s.expired(CDate(65535, 12, 31)) == ProdList{{"tea", 1}}) );
+    s.store("tea", CDate(2022, 1, 1), 5);
+    assert((s.expired(CDate(65535, 12, 31)) == ProdList{{"tea", 6}}));
+    l = {{"tea", 6}};
+    s.sell(l);
+    assert( l.empty() && s.expired(CDate(65535, 12, 31)).empty() );
+}
+
+void testExpired() {
+    CSupermarket s;
+    map<string, map<int, int>> stock;
+    srand(11);
+    for (int i = 0; i < 3000; i++) {
+        const int k = rand() % 20;
+        // names of different lengths are not typos of each other
+        const string name = string(k + 1, 'a' + k);
+        const int day = rand() % 40;
+        if (rand() % 3) {
+            const int count = 1 + rand() % 10;
+            s.store(name, CDate(2022, 1 + day / 28, 1 + day % 28), count);
+            stock[name][day] += count;
+        } else {
+            int count = 1 + rand() % 30;
+            ProdList l = {{name, count}};
+            s.sell(l);
+            map<int, int> & days = stock[name];
+            while (count > 0 && !days.empty()) {
+                const int sold = min(count, days.begin() -> second);
+                count -= sold;
+                if ((days.begin() -> second -= sold) == 0) days.erase(days.begin());
+            }
+            assert( count == (l.empty() ? 0 : l.front().second) );
+        }
+        const int day2 = rand() % 42;
+        vector<NameCount> expected;
+        for (const auto & [product, days] : stock) {
+            int sum = 0;
+            for (const auto & [stockDay, count] : days)
+                if (stockDay < day2) sum += count;
+            if (sum) expected.emplace_back(product, sum);
+        }
+        sort(expected.begin(), expected.end(), cmp::CountCmpInv());
+        ProdList expectedList;
+        for (const NameCount & item : expected) expectedList.emplace_back(item.name, item.count);
+        assert( s.expired(CDate(2022, 1 + day2 / 28, 1 + day2 % 28)) == expectedList );
+    }
+}
+
+/** Product the name given would be sold as, the same name or the only one
+ * stocked differing in one character, "" if there is none */
+string testResolve(const map<string, int> & stock, const string & name) {
+    if (stock.count(name)) return name;
+    string found;
+    for (const auto & [product, count] : stock) {
+        if (product.length() != name.length()) continue;
+        size_t diff = 0;
+        for (size_t i = 0; i < name.length(); i++) diff += product[i] != name[i];
+        if (diff != 1) continue;
+        if (!found.empty()) return "";
+        found = product;
+    }
+    return found;
+}
+
+void testTypos() {
+    CSupermarket s;
+    map<string, int> stock;
+    srand(7);
+    for (int i = 0; i < 5000; i++) {
+        string name = string(2 + rand() % 2, 'a');
+        for (char & c : name) c += rand() % 3;
+        if (rand() % 2) {
+            s.store(name, CDate(2022, 1, 1 + rand() % 3), 1);
+            stock[name]++;
+        } else {
+            ProdList l = {{name, 1}};
+            s.sell(l);
+            const string product = testResolve(stock, name);
+            assert( l.empty() == !product.empty() );
+            if (!product.empty() && --stock[product] == 0) stock.erase(product);
+        }
+    }
+}
+
+void testSellBatch() {
+    srand(5);
+    for (int round = 0; round < 20; round++) {
+        CSupermarket s;
+        for (int i = 0; i < 60; i++) {
+            string name = string(2 + rand() % 2, 'a');
+            for (char & c : name) c += rand() % 3;
+            s.store(name, CDate(2022, 1, 1 + rand() % 5), 1 + rand() % 5);
+        }
+        vector<ProdList> lists(1 + rand() % 300);
+        for (ProdList & l : lists)
+            for (int i = rand() % 4; i >= 0; i--) {
+                string name = string(2 + rand() % 2, 'a');
+                for (char & c : name) c += rand() % 3;
+                l.emplace_back(name, 1 + rand() % 4);
+            }
+        CSupermarket sequential = s;
+        vector<ProdList> sequentialLists = lists;
+        for (ProdList & l : sequentialLists)
+            sequential.sell(l);
+        // the threads share the lists in different ways
+        for (size_t threadCount = 0; threadCount <= 4; threadCount++) {
+            CSupermarket batch = s;
+            vector<ProdList> batchLists = lists;
+            batch.sellBatch(batchLists, threadCount);
+            assert( batchLists == sequentialLists );
+            assert( batch.expired(CDate(2023, 1, 1)) == sequential.expired(CDate(2023, 1, 1)) );
+        }
+        s.sellBatch(lists);
+        assert( lists == sequentialLists );
+        assert( s.expired(CDate(2023, 1, 1)) == sequential.expired(CDate(2023, 1, 1)) );
+    }
+}
+
 int main(void) {
     myTest();
+    testCopy();
+    testKeyIndex();
+    testNameTable();
+    testTypos();
+    testDays();
+    testExpired();
+    testSellBatch();
 
     CSupermarket s;
 
@@ -745,6 +1558,14 @@ int main(void) {
     assert( l15.size () == 1 );
     assert((l15 == list<pair<string,int>> { { "ccccc", 10 } }));
 
+#ifdef BENCHMARK
+    benchmarkStock();
+    benchmarkFuzzy();
+    benchmarkExpired();
+    benchmarkChurn();
+    benchmarkBatch();
+#endif /* BENCHMARK */
+
     cout << endl;
     printLine("It's done!");
     printLine("Yes, Mr. Frodo, it's over now.");